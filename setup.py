@@ -37,6 +37,7 @@ setup(
     packages=find_packages(),
     namespace_packages=["mood"],
     zip_safe=False,
+    headers=["src/mqueue_api.h"],
 
     ext_package="mood",
     ext_modules=[
@@ -47,7 +48,7 @@ setup(
                 "src/mqueue.c"
             ],
             define_macros=[PKG_VERSION],
-            libraries=["rt"]
+            libraries=["rt", "z"]
         )
     ],
 
@@ -3,21 +3,135 @@
 #include "structmember.h"
 
 #include "helpers/helpers.h"
+#include "mqueue_api.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <mqueue.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/resource.h>
 
+#include <zlib.h>
 
+
+#define MQUEUE_FS "/dev/mqueue"
+#define MQUEUE_REDUCTION "multiprocessing.reduction"
 #define MQUEUE_PROC_INTERFACE "/proc/sys/fs/mqueue"
 #define MQUEUE_DEFAULT_MAXMSG MQUEUE_PROC_INTERFACE "/msg_default"
 #define MQUEUE_MAX_MAXMSG MQUEUE_PROC_INTERFACE "/msg_max"
 #define MQUEUE_DEFAULT_MSGSIZE MQUEUE_PROC_INTERFACE "/msgsize_default"
 #define MQUEUE_MAX_MSGSIZE MQUEUE_PROC_INTERFACE "/msgsize_max"
 
+/* codec header byte */
+#define MQUEUE_CODEC_RAW 0
+#define MQUEUE_CODEC_ZLIB 1
+/* messages smaller than this are never compressed */
+#define MQUEUE_CODEC_MIN_SIZE 64
+/* sendall()/fill() try to pack up to this many payloads in 1 message */
+#define MQUEUE_CODEC_MAX_RATIO 8
 
-/* MessageQueue */
+
+/* spool journal */
+#define MQUEUE_SPOOL_MAGIC "MQSPOOL1"
+/* the journal file grows by at least this much */
+#define MQUEUE_SPOOL_GROWTH (1 << 20)
+/* refill thread: mq_timedsend() timeout and retry interval (nsec) */
+#define MQUEUE_SPOOL_TIMEOUT 100000000L
+#define MQUEUE_SPOOL_INTERVAL 1000000L
+
+#define _mqueue_spool_align(n) (((n) + 7) & ~((size_t)7))
+
+/* local queues: maximum number of distinct priorities in use */
+#define MQUEUE_LOCAL_MAX_RINGS 32
+#define MQUEUE_CACHELINE 64
+
+/* rpc: requests start with their id, then the size of the reply queue name
+   and the name, replies start with the id of the request and a status (0 or
+   an errno) */
+#define MQUEUE_RPC_REQUEST_HEADER (sizeof(uint64_t) + sizeof(uint16_t))
+#define MQUEUE_RPC_REPLY_HEADER (sizeof(uint64_t) + sizeof(int32_t))
+/* RpcServer: maximum number of reply queues kept open */
+#define MQUEUE_RPC_MAX_REPLIES 256
+
+
+/* reads through an array of iovec (the data of 1 or more messages) */
+typedef struct {
+    const struct iovec *iov;
+    size_t count;
+    size_t i;       // current iovec
+    size_t offset;  // in the current iovec
+} mqueue_iter;
+
+
+/* codec */
+typedef struct {
+    const char *name;
+    unsigned char id;
+    void *(*new)(void);
+    void (*free)(void *ctx);
+    /* compresses the next ssize bytes of src (left as is), returns the
+       compressed size, or 0 if it does not fit in dsize */
+    size_t (*compress)(void *ctx, const mqueue_iter *src, size_t ssize,
+                       char *dst, size_t dsize);
+    /* grows *dst as needed, returns the decompressed size or -1 (errno) */
+    Py_ssize_t (*decompress)(void *ctx, const char *src, size_t ssize,
+                             char **dst, size_t *dsize, size_t max);
+} mqueue_codec;
+
+
+/* spool journal header (at the start of the file) */
+typedef struct {
+    char magic[8];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t count;
+} mqueue_spool_header;
+
+
+/* spool journal record (8 bytes aligned) */
+typedef struct {
+    uint32_t size;
+    uint32_t priority;
+    char data[];
+} mqueue_spool_record;
+
+
+/* spool */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+    int error;
+    int fd;
+    size_t mapsize;
+    char *map;
+    mqd_t mqd;
+    char *msg;
+    size_t msgsize;
+    pid_t pid;  // the refill thread only runs in this process
+} mqueue_spool;
+
+
+/* receive buffer, used by one receiving thread at a time */
 typedef struct {
+    char *msg;
+    char *dec;
+    size_t decsize;
+} mqueue_buffer;
+
+
+/* MessageQueue */
+typedef struct MessageQueue {
     PyObject_HEAD
     PyObject *name;
     int flags;
@@ -25,13 +139,143 @@ typedef struct {
     struct mq_attr attr;
     mqd_t mqd;
     int owner;
-    char *msg;
+    pid_t pid;  // only unlinks (owner) from the process that opened it
+    mqueue_buffer *buffer;  // spare receive buffer, NULL while in use
     PyObject *callback;
+    PyInterpreterState *interp;
+    ino_t notified;  // inode, while registered for notification
+    const mqueue_codec *codec;
+    void *ctx;
+    char *enc;
+    pthread_mutex_t send_lock;  // guards ctx/enc
+    pthread_mutex_t receive_lock;  // guards ctx (decompression)
+    mqueue_spool *spool;
+    struct MessageQueue *prev;  // all the MessageQueue objects, see
+    struct MessageQueue *next;  // _mqueue_atfork_child()
 } MessageQueue;
 
 
+/* RecordQueue */
+typedef struct {
+    MessageQueue base;
+    PyObject *format;
+    Py_ssize_t itemsize;
+} RecordQueue;
+
+
+/* local ring cell (followed by msgsize bytes of data) */
+typedef struct {
+    size_t seq;
+    size_t size;
+    char data[];
+} mqueue_local_cell;
+
+
+/* local ring, bounded lock-free MPMC (1 per priority) */
+typedef struct {
+    unsigned int priority;
+    size_t mask;
+    size_t stride;
+    char *cells;
+    char _pad0[MQUEUE_CACHELINE];
+    size_t head;
+    char _pad1[MQUEUE_CACHELINE];
+    size_t tail;
+    char _pad2[MQUEUE_CACHELINE];
+} mqueue_local_ring;
+
+
+/* local queue, shared by all the LocalQueue objects with the same name */
+typedef struct {
+    Py_ssize_t refcnt;
+    long maxmsg;
+    long msgsize;
+    mode_t mode;
+    int rfd;    // eventfd, readable when the queue is not empty
+    int wfd;    // eventfd, readable when the queue is not full
+    char _pad0[MQUEUE_CACHELINE];
+    long reserved;
+    char _pad1[MQUEUE_CACHELINE];
+    long count;
+    char _pad2[MQUEUE_CACHELINE];
+    int nrings;
+    // orders[n] -> the first n rings, highest priority first
+    mqueue_local_ring **orders[MQUEUE_LOCAL_MAX_RINGS + 1];
+    void *notify;   // LocalQueue registered for notification (borrowed)
+} mqueue_local;
+
+
+/* LocalQueue */
+typedef struct {
+    PyObject_HEAD
+    PyObject *name;
+    int flags;
+    mode_t mode;
+    struct mq_attr attr;
+    mqueue_local *local;
+    int owner;
+    char *msg;
+    PyObject *callback;
+    int signum;
+    int cfd;    // eventfd, readable once this object is closed
+} LocalQueue;
+
+
+/* rpc call in flight */
+typedef struct mqueue_rpc_call {
+    struct mqueue_rpc_call *next;
+    uint64_t id;
+    int waited;     // a thread is waiting for the reply
+    int ready;      // the reply has been received
+    int status;     // 0 or the errno sent by the server
+    char *data;
+    Py_ssize_t size;
+} mqueue_rpc_call;
+
+
+/* RpcClient */
+typedef struct {
+    PyObject_HEAD
+    MessageQueue *requests;
+    MessageQueue *replies;
+    pthread_mutex_t lock;       // calls, id and leader
+    pthread_cond_t cond;
+    pthread_mutex_t send_lock;  // msg and requests
+    int leader;                 // a thread is receiving replies
+    uint64_t id;
+    mqueue_rpc_call *calls;
+    char *msg;                  // request header followed by the payload
+    Py_ssize_t hdrsize;
+    Py_ssize_t maxsize;         // maximum payload size
+} RpcClient;
+
+
+/* RpcServer */
+typedef struct {
+    PyObject_HEAD
+    MessageQueue *requests;
+    PyObject *type;     // MessageQueue
+    PyObject *replies;  // reply queue name -> MessageQueue
+    char *msg;
+    Py_ssize_t msgsize;
+} RpcServer;
+
+
+/* scan() entry */
+typedef struct {
+    char name[NAME_MAX + 2];
+    long curmsgs;
+    long bytes;
+    long maxmsg;
+    long msgsize;
+    long notify_pid;
+} mqueue_scan_entry;
+
+
 /* module state */
 typedef struct {
+    PyObject *locals;
+    int reducer;  // registered with multiprocessing.reduction
     unsigned long max_bytes;
     long default_maxmsg;
     long max_maxmsg;
@@ -90,804 +334,5610 @@ _mqueue_get_limit(const char *filename, long *value)
 }
 
 
-/* --------------------------------------------------------------------------
-   MessageQueue
-   -------------------------------------------------------------------------- */
-
-static inline MessageQueue *
-__mq_new(PyTypeObject *type)
-{
-    MessageQueue *self = NULL;
-
-    if ((self = PyObject_GC_NEW(MessageQueue, type))) {
-        self->name = NULL;
-        self->flags = 0;
-        self->mode = S_IRUSR | S_IWUSR; // ReadWrite by owner;
-        self->attr.mq_flags = 0;
-        self->attr.mq_maxmsg = -1;
-        self->attr.mq_msgsize = -1;
-        self->attr.mq_curmsgs = 0;
-        self->mqd = -1;
-        self->owner = 0;
-        self->msg = NULL;
-        self->callback = NULL;
-        PyObject_GC_Track(self);
-    }
-    return self;
-}
-
-
-static inline int
-__mq_init(MessageQueue *self, PyObject *args, PyObject *kwargs)
+static int
+_mqueue_check_attr(module_state *state, struct mq_attr *attr)
 {
-    static char *kwlist[] = {"name", "flags", "mode", "maxmsg", "msgsize", NULL};
-    module_state *state = NULL;
-    unsigned long bytes = 0;
-    const char *name = NULL;
-    struct stat st = { 0 };
-
-    if (
-        !(state = __PyObject_GetState__((PyObject *)self)) ||
-        !PyArg_ParseTupleAndKeywords(
-            args, kwargs, "O&i|Ill:__new__", kwlist,
-            PyUnicode_FSConverter, &self->name,
-            &self->flags, &self->mode,
-            &self->attr.mq_maxmsg, &self->attr.mq_msgsize
-        )
-    ) {
-        return -1;
-    }
-
-    if (self->attr.mq_maxmsg < 0) {
-        self->attr.mq_maxmsg = state->default_maxmsg;
+    if (attr->mq_maxmsg < 0) {
+        attr->mq_maxmsg = state->default_maxmsg;
     }
-    else if (self->attr.mq_maxmsg < state->min_maxmsg) {
-        self->attr.mq_maxmsg = state->min_maxmsg;
+    else if (attr->mq_maxmsg < state->min_maxmsg) {
+        attr->mq_maxmsg = state->min_maxmsg;
     }
-    if (self->attr.mq_maxmsg > state->max_maxmsg) {
+    if (attr->mq_maxmsg > state->max_maxmsg) {
         PyErr_Format(
             PyExc_OverflowError,
             "number of messages in queue (%ld) exceeds '%s' (%ld)",
-            self->attr.mq_maxmsg,
+            attr->mq_maxmsg,
             MQUEUE_MAX_MAXMSG,
             state->max_maxmsg
         );
         return -1;
     }
 
-    if (self->attr.mq_msgsize < 0) {
-        self->attr.mq_msgsize = state->default_msgsize;
+    if (attr->mq_msgsize < 0) {
+        attr->mq_msgsize = state->default_msgsize;
     }
-    else if (self->attr.mq_msgsize < state->min_msgsize) {
-        self->attr.mq_msgsize = state->min_msgsize;
+    else if (attr->mq_msgsize < state->min_msgsize) {
+        attr->mq_msgsize = state->min_msgsize;
     }
     /*else {
         // XXX: hmm...?
-        self->attr.mq_msgsize = ((self->attr.mq_msgsize + 7) & ~7);
+        attr->mq_msgsize = ((attr->mq_msgsize + 7) & ~7);
     }*/
-    if (self->attr.mq_msgsize > state->max_msgsize) {
+    if (attr->mq_msgsize > state->max_msgsize) {
         PyErr_Format(
             PyExc_OverflowError,
             "message size (%ld) exceeds '%s' (%ld)",
-            self->attr.mq_msgsize,
+            attr->mq_msgsize,
             MQUEUE_MAX_MSGSIZE,
             state->max_msgsize
         );
         return -1;
     }
+    return 0;
+}
 
-    /*
-        the error given by linux in case of overflow is not obvious (EMFILE).
-        unfortunately the 96 is platform dependent but it relies on size of
-        stucts that are not exposed (though it seems accurate on x86_64).
-    */
-    bytes = (96 + self->attr.mq_msgsize) * self->attr.mq_maxmsg;
-    if (bytes > state->max_bytes) {
-        PyErr_Format(
-            PyExc_OverflowError,
-            "message queue total size (%lu) exceeds 'RLIMIT_MSGQUEUE' (%lu)",
-            bytes,
-            state->max_bytes
-        );
-        return -1;
-    }
-
-    name = PyBytes_AS_STRING(self->name);
-    if ((self->flags & O_CREAT)) {
-        int flags = self->flags | O_EXCL;
-        int saved_errno = errno;
-        if (((self->mqd = mq_open(name, flags, self->mode, &self->attr)) == -1)) {
-            if ((flags != self->flags) && (errno == EEXIST)) {
-                errno = saved_errno;
-                self->mqd = mq_open(name, self->flags, self->mode, &self->attr);
-            }
-        }
-        else {
-            self->owner = 1;
-        }
-    }
-    else {
-        self->mqd = mq_open(name, self->flags, self->mode, &self->attr);
-    }
-    if (self->mqd == -1) {
-        switch (errno) {
-            case EACCES:
-            case EEXIST:
-            case ENAMETOOLONG:
-            case ENOENT:
-                _PyErr_SetFromErrnoWithFilename(name);
-                break;
-            default:
-                _PyErr_SetFromErrno();
-                break;
-        }
-        return -1;
-    }
-
-    if (fstat(self->mqd, &st)) {
-        _PyErr_SetFromErrno();
-        return -1;
-    }
-    self->mode = st.st_mode;
-
-    if (mq_getattr(self->mqd, &self->attr)) {
-        _PyErr_SetFromErrno();
-        return -1;
-    }
 
-    if (!(self->msg = PyObject_Malloc(self->attr.mq_msgsize))) {
-        PyErr_NoMemory();
-        return -1;
-    }
+/* --------------------------------------------------------------------------
+   iter
+   -------------------------------------------------------------------------- */
 
-    return 0;
+static inline void
+__iter_init(mqueue_iter *iter, const struct iovec *iov, size_t count)
+{
+    iter->iov = iov;
+    iter->count = count;
+    iter->i = 0;
+    iter->offset = 0;
 }
 
 
-static inline int
-__mq_close(MessageQueue *self)
+/* the next contiguous run of data (up to size bytes), returns its size */
+static inline size_t
+__iter_next(mqueue_iter *iter, size_t size, const char **data)
 {
-    const char *name = PyBytes_AS_STRING(self->name);
-    int res = 0;
+    size_t n = 0;
 
-    if (self->mqd != -1) {
-        if ((res = mq_close(self->mqd))) {
-            _PyErr_SetFromErrno();
-        }
-        else if (self->owner && (res = mq_unlink(name))) {
-            _PyErr_SetFromErrnoWithFilename(name);
-        }
-        self->mqd = -1;
+    // skip the empty ones
+    while (
+        (iter->i < iter->count) &&
+        (iter->offset == iter->iov[iter->i].iov_len)
+    ) {
+        ++iter->i;
+        iter->offset = 0;
     }
-    return res;
+    if (iter->i < iter->count) {
+        n = Py_MIN((iter->iov[iter->i].iov_len - iter->offset), size);
+        *data = ((const char *)iter->iov[iter->i].iov_base + iter->offset);
+        iter->offset += n;
+    }
+    return n;
 }
 
 
-static inline int
-__mq_getblocking(MessageQueue *self)
+/* the next size bytes, if they are contiguous (no copy needed) */
+static inline const char *
+__iter_contiguous(const mqueue_iter *iter, size_t size)
 {
-    return ((self->attr.mq_flags & O_NONBLOCK) == 0);
+    mqueue_iter tmp = *iter;
+    const char *data = "";
+
+    return (__iter_next(&tmp, size, &data) == size) ? data : NULL;
 }
 
-static inline int
-__mq_setblocking(MessageQueue *self, int blocking)
+
+/* copies (up to) the next size bytes into dst, returns the number copied */
+static size_t
+__iter_gather(mqueue_iter *iter, char *dst, size_t size)
 {
-    struct mq_attr attr = { 0 };
+    const char *data = NULL;
+    size_t copied = 0, n = 0;
 
-    if (blocking != __mq_getblocking(self)) {
-        attr.mq_flags = (blocking) ? 0 : O_NONBLOCK;
-        if (mq_setattr(self->mqd, &attr, NULL)) {
-            _PyErr_SetFromErrno();
-            return -1;
-        }
-        self->attr.mq_flags = attr.mq_flags;
-        // should we?
-        if (blocking) {
-            self->flags &= ~O_NONBLOCK;
-        }
-        else {
-            self->flags |= O_NONBLOCK;
-        }
+    while ((copied < size) && (n = __iter_next(iter, (size - copied), &data))) {
+        memcpy((dst + copied), data, n);
+        copied += n;
     }
-    return 0;
+    return copied;
 }
 
 
-/* -------------------------------------------------------------------------- */
-
-static inline int
-__mq_send(MessageQueue *self, const char *buf, Py_ssize_t size, unsigned int priority)
+static inline void
+__iter_skip(mqueue_iter *iter, size_t size)
 {
-    int res = -1;
+    const char *data = NULL;
+    size_t n = 0;
 
-    Py_BEGIN_ALLOW_THREADS
-    res = mq_send(self->mqd, buf, size, priority);
-    Py_END_ALLOW_THREADS
-    return res;
+    while (size && (n = __iter_next(iter, size, &data))) {
+        size -= n;
+    }
 }
 
 
-static inline Py_ssize_t
-__mq_receive(MessageQueue *self)
-{
-    Py_ssize_t size = -1;
-
-    Py_BEGIN_ALLOW_THREADS
-    size = mq_receive(self->mqd, self->msg, self->attr.mq_msgsize, NULL);
-    Py_END_ALLOW_THREADS
-    return size;
-}
+/* --------------------------------------------------------------------------
+   codecs
+   -------------------------------------------------------------------------- */
 
+typedef struct {
+    z_stream deflate;
+    z_stream inflate;
+} zlib_ctx;
 
-/* MessageQueue_Type -------------------------------------------------------- */
 
-/* MessageQueue_Type.tp_new */
-static PyObject *
-MessageQueue_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+static void *
+_zlib_new(void)
 {
-    MessageQueue *self = NULL;
+    zlib_ctx *ctx = NULL;
 
-    if ((self = __mq_new(type)) && __mq_init(self, args, kwargs)) {
-        Py_CLEAR(self);
+    if ((ctx = PyMem_RawCalloc(1, sizeof(zlib_ctx)))) {
+        if (deflateInit(&ctx->deflate, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            PyMem_RawFree(ctx);
+            return NULL;
+        }
+        if (inflateInit(&ctx->inflate) != Z_OK) {
+            deflateEnd(&ctx->deflate);
+            PyMem_RawFree(ctx);
+            return NULL;
+        }
     }
-    return (PyObject *)self;
+    return ctx;
 }
 
 
-/* MessageQueue_Type.tp_traverse */
-static int
-MessageQueue_tp_traverse(MessageQueue *self, visitproc visit, void *arg)
+static void
+_zlib_free(void *ctx)
 {
-    Py_VISIT(self->callback);
-    Py_VISIT(self->name);
-    Py_VISIT(Py_TYPE(self)); // heap type
-    return 0;
+    deflateEnd(&((zlib_ctx *)ctx)->deflate);
+    inflateEnd(&((zlib_ctx *)ctx)->inflate);
+    PyMem_RawFree(ctx);
 }
 
 
-/* MessageQueue_Type.tp_finalize */
-static void
-MessageQueue_tp_finalize(MessageQueue *self)
+/* fed straight from the iovecs, no staging */
+static size_t
+_zlib_compress(void *ctx, const mqueue_iter *src, size_t ssize, char *dst,
+               size_t dsize)
 {
-    PyObject *exc_type, *exc_value, *exc_traceback;
+    z_stream *zs = &((zlib_ctx *)ctx)->deflate;
+    mqueue_iter iter = *src;
+    const char *data = NULL;
+    size_t n = 0;
+    int res = Z_OK;
+
+    deflateReset(zs);
+    zs->next_out = (Bytef *)dst;
+    zs->avail_out = dsize;
+    do {
+        n = __iter_next(&iter, ssize, &data);
+        ssize -= n;
+        zs->next_in = (Bytef *)data;
+        zs->avail_in = n;
+        res = deflate(zs, (ssize && n) ? Z_NO_FLUSH : Z_FINISH);
+    } while ((res == Z_OK) && ssize && n && !zs->avail_in);
+    return (res == Z_STREAM_END) ? zs->total_out : 0;
+}
+
+
+/* never writes more than max bytes, fails with EBADMSG if the message does
+   not fit */
+static Py_ssize_t
+_zlib_decompress(void *ctx, const char *src, size_t ssize,
+                 char **dst, size_t *dsize, size_t max)
+{
+    z_stream *zs = &((zlib_ctx *)ctx)->inflate;
+    size_t size = 0;
+    char *buf = NULL;
+    int res = Z_OK;
+
+    inflateReset(zs);
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = ssize;
+    do {
+        if (zs->total_out == *dsize) {
+            if (*dsize >= max) {
+                errno = EBADMSG;
+                return -1;
+            }
+            size = Py_MIN(Py_MAX((*dsize << 1), (ssize << 2)), max);
+            if (!(buf = PyMem_RawRealloc(*dst, size))) {
+                errno = ENOMEM;
+                return -1;
+            }
+            *dst = buf;
+            *dsize = size;
+        }
+        zs->next_out = (Bytef *)(*dst + zs->total_out);
+        zs->avail_out = *dsize - zs->total_out;
+        res = inflate(zs, Z_FINISH);
+    } while ((res == Z_OK || res == Z_BUF_ERROR) && zs->avail_out == 0);
+    if (res != Z_STREAM_END) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return zs->total_out;
+}
+
+
+static const mqueue_codec mqueue_zlib_codec = {
+    .name = "zlib",
+    .id = MQUEUE_CODEC_ZLIB,
+    .new = _zlib_new,
+    .free = _zlib_free,
+    .compress = _zlib_compress,
+    .decompress = _zlib_decompress
+};
+
+
+static const mqueue_codec *mqueue_codecs[] = {
+    &mqueue_zlib_codec,
+    NULL  /* Sentinel */
+};
+
+
+static const mqueue_codec *
+_mqueue_get_codec(const char *name)
+{
+    const mqueue_codec **codec = NULL;
+
+    for (codec = mqueue_codecs; *codec; ++codec) {
+        if (!strcmp((*codec)->name, name)) {
+            return *codec;
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "unknown codec: '%s'", name);
+    return NULL;
+}
+
+
+/* --------------------------------------------------------------------------
+   spool
+   -------------------------------------------------------------------------- */
+
+static inline mqueue_spool_header *
+__spool_header(mqueue_spool *spool)
+{
+    return (mqueue_spool_header *)spool->map;
+}
+
+
+static inline void
+__spool_deadline(struct timespec *ts, long nsec)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    if ((ts->tv_nsec += nsec) >= 1000000000L) {
+        ts->tv_sec += ts->tv_nsec / 1000000000L;
+        ts->tv_nsec %= 1000000000L;
+    }
+}
+
+
+/* lock must be held */
+static int
+__spool_grow(mqueue_spool *spool, size_t size)
+{
+    size_t mapsize = Py_MAX(size, (spool->mapsize + MQUEUE_SPOOL_GROWTH));
+    void *map = NULL;
+
+    if (ftruncate(spool->fd, mapsize)) {
+        return -1;
+    }
+    if (spool->map) {
+        map = mremap(spool->map, spool->mapsize, mapsize, MREMAP_MAYMOVE);
+    }
+    else {
+        map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   spool->fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    spool->map = map;
+    spool->mapsize = mapsize;
+    return 0;
+}
+
+
+/* moves the records back to the start of the journal, only when they fit
+   in the space already sent (the copy does not overwrite them, and a crash
+   before the header is updated leaves the journal as it was).
+   lock must be held, returns 1 if it was compacted */
+static int
+__spool_compact(mqueue_spool *spool)
+{
+    mqueue_spool_header *header = __spool_header(spool);
+    size_t start = sizeof(*header), live = header->tail - header->head;
+
+    if ((header->head == start) || (live >= (header->head - start))) {
+        return 0;
+    }
+    memcpy((spool->map + start), (spool->map + header->head), live);
+    // tail first: a crash in between leaves head > tail, which
+    // __spool_check() rejects rather than replaying stale records
+    __atomic_store_n(&header->tail, (start + live), __ATOMIC_RELEASE);
+    header->head = start;
+    return 1;
+}
+
+
+/* lock must be held */
+static int
+__spool_append(mqueue_spool *spool, const char *buf, size_t size,
+               unsigned int priority)
+{
+    mqueue_spool_header *header = __spool_header(spool);
+    mqueue_spool_record *record = NULL;
+    size_t len = _mqueue_spool_align(sizeof(*record) + size);
+    size_t tail = header->tail, ntail = tail + len;
+
+    // reuse the space already sent before growing the file
+    if ((ntail > spool->mapsize) && __spool_compact(spool)) {
+        tail = header->tail;
+        ntail = tail + len;
+    }
+    if (ntail > spool->mapsize) {
+        if (__spool_grow(spool, ntail)) {
+            return -1;
+        }
+        header = __spool_header(spool);
+    }
+    record = (mqueue_spool_record *)(spool->map + tail);
+    record->size = size;
+    record->priority = priority;
+    memcpy(record->data, buf, size);
+    // the record must be complete before it becomes visible
+    __atomic_store_n(&header->tail, ntail, __ATOMIC_RELEASE);
+    header->count++;
+    return 0;
+}
+
+
+/* lock must be held */
+static void
+__spool_pop(mqueue_spool *spool)
+{
+    mqueue_spool_header *header = __spool_header(spool);
+    mqueue_spool_record *record =
+        (mqueue_spool_record *)(spool->map + header->head);
+
+    header->count--;
+    if (!header->count) {
+        // empty, rewind
+        header->head = header->tail = sizeof(*header);
+    }
+    else {
+        header->head += _mqueue_spool_align(sizeof(*record) + record->size);
+        // under a sustained backlog the journal never empties, don't let it
+        // grow forever
+        if (header->head >= (spool->mapsize >> 1)) {
+            __spool_compact(spool);
+        }
+    }
+}
+
+
+static void *
+__spool_refill(void *arg)
+{
+    mqueue_spool *spool = arg;
+    mqueue_spool_header *header = NULL;
+    mqueue_spool_record *record = NULL;
+    struct timespec ts = { 0 };
+    size_t size = 0;
+    unsigned int priority = 0;
+    int res = 0;
+
+    pthread_mutex_lock(&spool->lock);
+    while (!spool->stop) {
+        header = __spool_header(spool);
+        if (!header->count) {
+            pthread_cond_wait(&spool->cond, &spool->lock);
+            continue;
+        }
+        record = (mqueue_spool_record *)(spool->map + header->head);
+        if ((size = record->size) > spool->msgsize) {
+            spool->error = EBADMSG;
+            break;
+        }
+        priority = record->priority;
+        memcpy(spool->msg, record->data, size);
+        pthread_mutex_unlock(&spool->lock);
+        __spool_deadline(&ts, MQUEUE_SPOOL_TIMEOUT);
+        res = mq_timedsend(spool->mqd, spool->msg, size, priority, &ts);
+        pthread_mutex_lock(&spool->lock);
+        if (!res) {
+            __spool_pop(spool);
+        }
+        else if (errno == EAGAIN) {
+            // nonblocking queue, poll
+            __spool_deadline(&ts, MQUEUE_SPOOL_INTERVAL);
+            pthread_cond_timedwait(&spool->cond, &spool->lock, &ts);
+        }
+        else if (errno != ETIMEDOUT && errno != EINTR) {
+            spool->error = errno;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return NULL;
+}
+
+
+/* sends 1 message or appends it to the journal if the queue is full */
+static int
+__spool_send(mqueue_spool *spool, const char *buf, size_t size,
+             unsigned int priority)
+{
+    static const struct timespec expired = { 0 };
+    int res = -1;
+
+    pthread_mutex_lock(&spool->lock);
+    if (spool->error) {
+        pthread_mutex_unlock(&spool->lock);
+        errno = spool->error;
+        return -1;
+    }
+    if (!__spool_header(spool)->count) {
+        // nothing spooled, try to send it right away
+        pthread_mutex_unlock(&spool->lock);
+        if (!mq_timedsend(spool->mqd, buf, size, priority, &expired)) {
+            return 0;
+        }
+        if (errno != EAGAIN && errno != ETIMEDOUT) {
+            return -1;
+        }
+        pthread_mutex_lock(&spool->lock);
+    }
+    if (!(res = __spool_append(spool, buf, size, priority))) {
+        pthread_cond_signal(&spool->cond);
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return res;
+}
+
+
+static void
+__spool_free(mqueue_spool *spool)
+{
+    if (spool->map) {
+        munmap(spool->map, spool->mapsize);
+    }
+    if (spool->fd != -1) {
+        close(spool->fd);
+    }
+    PyMem_RawFree(spool->msg);
+    // inherited across fork(), lock and cond are in whatever state the refill
+    // thread left them (and destroying a cond can wait for its waiters)
+    if (spool->pid == getpid()) {
+        pthread_cond_destroy(&spool->cond);
+        pthread_mutex_destroy(&spool->lock);
+    }
+    PyMem_RawFree(spool);
+}
+
+
+/* checks an existing journal (mapped as is), every record must lie within
+   [head, tail) and fit in 1 message, recounts them */
+static int
+__spool_check(mqueue_spool *spool)
+{
+    mqueue_spool_header *header = __spool_header(spool);
+    mqueue_spool_record *record = NULL;
+    size_t head = header->head, tail = header->tail;
+    uint64_t count = 0;
+
+    if (
+        memcmp(header->magic, MQUEUE_SPOOL_MAGIC, sizeof(header->magic)) ||
+        (head < sizeof(*header)) ||
+        (head > tail) ||
+        (tail > spool->mapsize)
+    ) {
+        return -1;
+    }
+    while (head < tail) {
+        record = (mqueue_spool_record *)(spool->map + head);
+        if (
+            ((tail - head) < sizeof(*record)) ||
+            (record->size > spool->msgsize) ||
+            ((tail - head) < _mqueue_spool_align(sizeof(*record) + record->size))
+        ) {
+            return -1;
+        }
+        head += _mqueue_spool_align(sizeof(*record) + record->size);
+        count++;
+    }
+    // the tail is only moved once a record is complete, count comes after
+    header->count = count;
+    return 0;
+}
+
+
+static mqueue_spool *
+_mqueue_spool_new(const char *path, mqd_t mqd, long msgsize)
+{
+    mqueue_spool *spool = NULL;
+    mqueue_spool_header *header = NULL;
+    struct stat st = { 0 };
+    void *map = MAP_FAILED;
+    int res = -1;
+
+    if (!(spool = PyMem_RawCalloc(1, sizeof(mqueue_spool)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    pthread_mutex_init(&spool->lock, NULL);
+    pthread_cond_init(&spool->cond, NULL);
+    spool->fd = -1;
+    spool->mqd = mqd;
+    spool->msgsize = msgsize;
+    spool->pid = getpid();
+    if (!(spool->msg = PyMem_RawMalloc(msgsize))) {
+        __spool_free(spool);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    if (
+        ((spool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) != -1) &&
+        !flock(spool->fd, (LOCK_EX | LOCK_NB)) &&
+        !fstat(spool->fd, &st)
+    ) {
+        if (!st.st_size) {
+            res = __spool_grow(spool, 0);
+        }
+        else if ((size_t)st.st_size < sizeof(*header)) {
+            res = 0; // caught below
+        }
+        else if (
+            (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        spool->fd, 0)) != MAP_FAILED
+        ) {
+            // map it as is, it only grows once it is known to be valid
+            spool->map = map;
+            spool->mapsize = st.st_size;
+            res = 0;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    if (res) {
+        _PyErr_SetFromErrnoWithFilename(path);
+        __spool_free(spool);
+        return NULL;
+    }
+    if (!st.st_size) {
+        header = __spool_header(spool);
+        memcpy(header->magic, MQUEUE_SPOOL_MAGIC, sizeof(header->magic));
+        header->head = header->tail = sizeof(*header);
+        header->count = 0;
+    }
+    else if (!spool->map || __spool_check(spool)) {
+        PyErr_Format(PyExc_ValueError, "invalid spool journal: '%s'", path);
+        __spool_free(spool);
+        return NULL;
+    }
+    if ((res = pthread_create(&spool->thread, NULL, __spool_refill, spool))) {
+        errno = res;
+        _PyErr_SetFromErrno();
+        __spool_free(spool);
+        return NULL;
+    }
+    return spool;
+}
+
+
+static void
+_mqueue_spool_free(mqueue_spool *spool)
+{
+    // inherited across fork(), there is no refill thread here
+    if (spool->pid == getpid()) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&spool->lock);
+        spool->stop = 1;
+        pthread_cond_signal(&spool->cond);
+        pthread_mutex_unlock(&spool->lock);
+        pthread_join(spool->thread, NULL);
+        Py_END_ALLOW_THREADS
+    }
+    __spool_free(spool);
+}
+
+
+static uint64_t
+_mqueue_spool_count(mqueue_spool *spool)
+{
+    uint64_t count = 0;
+
+    pthread_mutex_lock(&spool->lock);
+    count = __spool_header(spool)->count;
+    pthread_mutex_unlock(&spool->lock);
+    return count;
+}
+
+
+/* --------------------------------------------------------------------------
+   local
+   -------------------------------------------------------------------------- */
+
+#define __local_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define __local_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define __local_cas(p, e, v) \
+    __atomic_compare_exchange_n((p), (e), (v), 1, \
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+
+
+static inline mqueue_local_cell *
+__ring_cell(mqueue_local_ring *ring, size_t pos)
+{
+    return (mqueue_local_cell *)(ring->cells + ((pos & ring->mask) * ring->stride));
+}
+
+
+static int
+__ring_push(mqueue_local_ring *ring, const char *buf, size_t size)
+{
+    mqueue_local_cell *cell = NULL;
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    intptr_t diff = 0;
+
+    for (;;) {
+        cell = __ring_cell(ring, pos);
+        diff = (intptr_t)__local_load(&cell->seq) - (intptr_t)pos;
+        if (!diff) {
+            if (__local_cas(&ring->head, &pos, (pos + 1))) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return -1; // full
+        }
+        else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->size = size;
+    memcpy(cell->data, buf, size);
+    __local_store(&cell->seq, (pos + 1));
+    return 0;
+}
+
+
+static Py_ssize_t
+__ring_pop(mqueue_local_ring *ring, char *buf)
+{
+    mqueue_local_cell *cell = NULL;
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    intptr_t diff = 0;
+    Py_ssize_t size = 0;
+
+    for (;;) {
+        cell = __ring_cell(ring, pos);
+        diff = (intptr_t)__local_load(&cell->seq) - (intptr_t)(pos + 1);
+        if (!diff) {
+            if (__local_cas(&ring->tail, &pos, (pos + 1))) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return -1; // empty
+        }
+        else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    size = cell->size;
+    memcpy(buf, cell->data, size);
+    __local_store(&cell->seq, (pos + ring->mask + 1));
+    return size;
+}
+
+
+static void
+__ring_free(mqueue_local_ring *ring)
+{
+    PyMem_RawFree(ring->cells);
+    PyMem_RawFree(ring);
+}
+
+
+static mqueue_local_ring *
+__ring_new(unsigned int priority, long maxmsg, long msgsize)
+{
+    mqueue_local_ring *ring = NULL;
+    size_t capacity = 1, i;
+
+    while (capacity < (size_t)maxmsg) {
+        capacity <<= 1;
+    }
+    if ((ring = PyMem_RawCalloc(1, sizeof(mqueue_local_ring)))) {
+        ring->priority = priority;
+        ring->mask = capacity - 1;
+        ring->stride = (sizeof(mqueue_local_cell) + msgsize + 7) & ~((size_t)7);
+        if (!(ring->cells = PyMem_RawMalloc(capacity * ring->stride))) {
+            __ring_free(ring);
+            return NULL;
+        }
+        for (i = 0; i < capacity; ++i) {
+            __ring_cell(ring, i)->seq = i;
+        }
+    }
+    return ring;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static inline void
+__local_signal(int fd)
+{
+    eventfd_write(fd, 1);
+}
+
+
+static inline void
+__local_clear(int fd)
+{
+    eventfd_t value;
+
+    eventfd_read(fd, &value);
+}
+
+
+/* waits for fd to be readable, fails with EBADF once cfd is */
+static inline int
+__local_wait(int fd, int cfd)
+{
+    struct pollfd pfds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = cfd, .events = POLLIN }
+    };
+
+    if (poll(pfds, 2, -1) < 0) {
+        return -1;
+    }
+    if (pfds[1].revents) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+
+static void
+_mqueue_local_decref(mqueue_local *local)
+{
+    int i;
+
+    if (--local->refcnt) {
+        return;
+    }
+    for (i = 0; i < local->nrings; ++i) {
+        __ring_free(local->orders[local->nrings][i]);
+    }
+    for (i = 1; i <= local->nrings; ++i) {
+        PyMem_RawFree(local->orders[i]);
+    }
+    if (local->rfd != -1) {
+        close(local->rfd);
+    }
+    if (local->wfd != -1) {
+        close(local->wfd);
+    }
+    PyMem_RawFree(local);
+}
+
+
+static mqueue_local *
+_mqueue_local_new(long maxmsg, long msgsize, mode_t mode)
+{
+    mqueue_local *local = NULL;
+
+    if (!(local = PyMem_RawCalloc(1, sizeof(mqueue_local)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    local->refcnt = 1;
+    local->maxmsg = maxmsg;
+    local->msgsize = msgsize;
+    local->mode = S_IFREG | (mode & 07777);
+    local->rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    local->wfd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (local->rfd == -1 || local->wfd == -1) {
+        _PyErr_SetFromErrno();
+        _mqueue_local_decref(local);
+        return NULL;
+    }
+    return local;
+}
+
+
+/* returns the ring for priority, creating it if needed (GIL must be held) */
+static mqueue_local_ring *
+_mqueue_local_ring(mqueue_local *local, unsigned int priority)
+{
+    int i, n = __local_load(&local->nrings);
+    mqueue_local_ring **rings = local->orders[n], **order = NULL;
+    mqueue_local_ring *ring = NULL;
+
+    for (i = 0; i < n; ++i) {
+        if (rings[i]->priority == priority) {
+            return rings[i];
+        }
+    }
+    if (priority >= MQ_PRIO_MAX) {
+        errno = EINVAL;
+        _PyErr_SetFromErrno();
+        return NULL;
+    }
+    if (n == MQUEUE_LOCAL_MAX_RINGS) {
+        PyErr_Format(
+            PyExc_OverflowError,
+            "number of distinct priorities exceeds %d",
+            MQUEUE_LOCAL_MAX_RINGS
+        );
+        return NULL;
+    }
+    if (
+        !(ring = __ring_new(priority, local->maxmsg, local->msgsize)) ||
+        !(order = PyMem_RawMalloc((n + 1) * sizeof(mqueue_local_ring *)))
+    ) {
+        if (ring) {
+            __ring_free(ring);
+        }
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i = 0; (i < n) && (rings[i]->priority > priority); ++i) {
+        order[i] = rings[i];
+    }
+    order[i] = ring;
+    for (; i < n; ++i) {
+        order[i + 1] = rings[i];
+    }
+    local->orders[n + 1] = order;
+    __local_store(&local->nrings, (n + 1));
+    return ring;
+}
+
+
+/* returns 1 if the queue was empty, 0 if not, -1 on error (errno),
+   blocking, waits until there is room or cfd is readable */
+static int
+_mqueue_local_send(mqueue_local *local, mqueue_local_ring *ring,
+                   const char *buf, size_t size, int blocking, int cfd)
+{
+    long reserved = __atomic_load_n(&local->reserved, __ATOMIC_RELAXED);
+
+    for (;;) {
+        if (reserved < local->maxmsg) {
+            if (__local_cas(&local->reserved, &reserved, (reserved + 1))) {
+                break;
+            }
+        }
+        else if (!blocking) {
+            errno = EAGAIN;
+            return -1;
+        }
+        else if (__local_wait(local->wfd, cfd)) {
+            return -1;
+        }
+        else {
+            reserved = __local_load(&local->reserved);
+        }
+    }
+    if ((reserved + 1) == local->maxmsg) {
+        // we filled it
+        __local_clear(local->wfd);
+        if (__local_load(&local->reserved) < local->maxmsg) {
+            __local_signal(local->wfd);
+        }
+    }
+    // a slot is reserved, the ring can only be 'full' while a consumer is
+    // still copying out of the cell we want
+    while (__ring_push(ring, buf, size)) {
+        sched_yield();
+    }
+    if (!__atomic_fetch_add(&local->count, 1, __ATOMIC_ACQ_REL)) {
+        __local_signal(local->rfd);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* never waits, fails with EAGAIN if the queue is empty */
+static Py_ssize_t
+_mqueue_local_receive(mqueue_local *local, char *buf)
+{
+    mqueue_local_ring **rings = NULL;
+    Py_ssize_t size = -1;
+    int i, n;
+
+    n = __local_load(&local->nrings);
+    rings = local->orders[n];
+    for (i = 0; (i < n) && ((size = __ring_pop(rings[i], buf)) < 0); ++i);
+    if (size < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (__atomic_fetch_sub(&local->count, 1, __ATOMIC_ACQ_REL) == 1) {
+        // we emptied it
+        __local_clear(local->rfd);
+        if (__local_load(&local->count) > 0) {
+            __local_signal(local->rfd);
+        }
+    }
+    if (__atomic_fetch_sub(&local->reserved, 1, __ATOMIC_ACQ_REL) == local->maxmsg) {
+        __local_signal(local->wfd);
+    }
+    return size;
+}
+
+
+static inline long
+_mqueue_local_count(mqueue_local *local)
+{
+    long count = __local_load(&local->count);
+
+    return (count < 0) ? 0 : count;
+}
+
+
+/* --------------------------------------------------------------------------
+   MessageQueue
+   -------------------------------------------------------------------------- */
+
+static void
+__mq_buffer_free(mqueue_buffer *buffer)
+{
+    if (buffer) {
+        PyMem_RawFree(buffer->msg);
+        PyMem_RawFree(buffer->dec);
+        PyMem_RawFree(buffer);
+    }
+}
+
+
+/* can be called without the GIL */
+static mqueue_buffer *
+__mq_buffer_new(size_t size)
+{
+    mqueue_buffer *buffer = NULL;
+
+    if (
+        !(buffer = PyMem_RawCalloc(1, sizeof(mqueue_buffer))) ||
+        !(buffer->msg = PyMem_RawMalloc(size))
+    ) {
+        __mq_buffer_free(buffer);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return buffer;
+}
+
+
+/* takes the spare receive buffer, or a new one if another thread is using it
+   (no lock is held while waiting for a message) */
+static inline mqueue_buffer *
+__mq_buffer_get(MessageQueue *self)
+{
+    mqueue_buffer *buffer = NULL;
+
+    if (
+        !(buffer = __atomic_exchange_n(&self->buffer, NULL, __ATOMIC_ACQUIRE))
+    ) {
+        buffer = __mq_buffer_new(self->attr.mq_msgsize);
+    }
+    return buffer;
+}
+
+
+/* gives the buffer back (keeps it as the spare one if there is none) */
+static inline void
+__mq_buffer_put(MessageQueue *self, mqueue_buffer *buffer)
+{
+    mqueue_buffer *spare = NULL;
+
+    if (
+        !__atomic_compare_exchange_n(&self->buffer, &spare, buffer, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+    ) {
+        __mq_buffer_free(buffer);
+    }
+}
+
+
+/* scan() must not open the queues this process is registered for
+   notification on (closing any descriptor of a queue cancels its
+   registration), keeps track of their inodes.
+   Registrations are per process, not per interpreter, and are not inherited
+   by a child process (so the inodes are only valid in pid) */
+static struct {
+    pthread_mutex_t lock;
+    pid_t pid;
+    ino_t *inodes;
+    size_t count;
+    size_t alloc;
+} mqueue_notified = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0, 0 };
+
+
+/* mqueue_notified.lock must be held */
+static inline void
+__notified_check_pid(void)
+{
+    pid_t pid = getpid();
+
+    if (mqueue_notified.pid != pid) {
+        mqueue_notified.pid = pid;
+        mqueue_notified.count = 0;
+    }
+}
+
+
+/* no GIL needed, returns 0 or -1 (ENOMEM) */
+static int
+_mqueue_notified_add(ino_t ino)
+{
+    ino_t *inodes = NULL;
+    size_t alloc = 0;
+    int res = 0;
+
+    pthread_mutex_lock(&mqueue_notified.lock);
+    __notified_check_pid();
+    if (mqueue_notified.count == mqueue_notified.alloc) {
+        alloc = Py_MAX((mqueue_notified.alloc << 1), 16);
+        if (
+            (inodes = PyMem_RawRealloc(mqueue_notified.inodes,
+                                       (alloc * sizeof(ino_t))))
+        ) {
+            mqueue_notified.inodes = inodes;
+            mqueue_notified.alloc = alloc;
+        }
+        else {
+            errno = ENOMEM;
+            res = -1;
+        }
+    }
+    if (!res) {
+        mqueue_notified.inodes[mqueue_notified.count++] = ino;
+    }
+    pthread_mutex_unlock(&mqueue_notified.lock);
+    return res;
+}
+
+
+/* no GIL needed */
+static void
+_mqueue_notified_remove(ino_t ino)
+{
+    size_t i;
+
+    pthread_mutex_lock(&mqueue_notified.lock);
+    __notified_check_pid();
+    for (i = 0; i < mqueue_notified.count; ++i) {
+        if (mqueue_notified.inodes[i] == ino) {
+            mqueue_notified.inodes[i] =
+                mqueue_notified.inodes[--mqueue_notified.count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mqueue_notified.lock);
+}
+
+
+/* no GIL needed */
+static int
+_mqueue_notified_contains(ino_t ino)
+{
+    size_t i;
+
+    pthread_mutex_lock(&mqueue_notified.lock);
+    __notified_check_pid();
+    for (i = 0; (i < mqueue_notified.count) &&
+                (mqueue_notified.inodes[i] != ino); ++i);
+    pthread_mutex_unlock(&mqueue_notified.lock);
+    return (i < mqueue_notified.count);
+}
+
+
+/* fork() only duplicates the calling thread, the locks held by the others
+   (blocked sending, or the spool refill thread) would stay locked forever in
+   the child, they are reinitialized there */
+static struct {
+    pthread_mutex_t lock;
+    MessageQueue *head;
+} mqueue_handles = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+
+static void
+_mqueue_atfork_prepare(void)
+{
+    pthread_mutex_lock(&mqueue_handles.lock);
+    pthread_mutex_lock(&mqueue_notified.lock);
+}
+
+
+static void
+_mqueue_atfork_parent(void)
+{
+    pthread_mutex_unlock(&mqueue_notified.lock);
+    pthread_mutex_unlock(&mqueue_handles.lock);
+}
+
+
+/* only the forking thread is running here */
+static void
+_mqueue_atfork_child(void)
+{
+    MessageQueue *self = NULL;
+
+    for (self = mqueue_handles.head; self; self = self->next) {
+        pthread_mutex_init(&self->send_lock, NULL);
+        pthread_mutex_init(&self->receive_lock, NULL);
+        if (self->spool) {
+            // not used here (see _mq_send()), only by spooled
+            pthread_mutex_init(&self->spool->lock, NULL);
+            pthread_cond_init(&self->spool->cond, NULL);
+        }
+    }
+    pthread_mutex_init(&mqueue_notified.lock, NULL);
+    pthread_mutex_init(&mqueue_handles.lock, NULL);
+}
+
+
+static void
+__mq_atfork(void)
+{
+    pthread_atfork(_mqueue_atfork_prepare, _mqueue_atfork_parent,
+                   _mqueue_atfork_child);
+}
+
+
+static inline void
+__mq_link(MessageQueue *self)
+{
+    pthread_mutex_lock(&mqueue_handles.lock);
+    self->prev = NULL;
+    if ((self->next = mqueue_handles.head)) {
+        self->next->prev = self;
+    }
+    mqueue_handles.head = self;
+    pthread_mutex_unlock(&mqueue_handles.lock);
+}
+
+
+static inline void
+__mq_unlink(MessageQueue *self)
+{
+    pthread_mutex_lock(&mqueue_handles.lock);
+    if (self->prev) {
+        self->prev->next = self->next;
+    }
+    else {
+        mqueue_handles.head = self->next;
+    }
+    if (self->next) {
+        self->next->prev = self->prev;
+    }
+    pthread_mutex_unlock(&mqueue_handles.lock);
+}
+
+
+/* registers MessageQueue objects with multiprocessing.reduction (the way it
+   does for sockets), once it has been imported: importing it here would slow
+   down every import of this module */
+static int
+_mqueue_register_reducer(PyObject *module)
+{
+    module_state *state = NULL;
+    PyObject *reduction = NULL, *type = NULL, *reduce = NULL, *res = NULL;
+
+    if (!(state = __PyModule_GetState__(module))) {
+        return -1;
+    }
+    if (state->reducer) {
+        return 0;
+    }
+    if (
+        !(reduction = PyDict_GetItemString(PyImport_GetModuleDict(),
+                                           MQUEUE_REDUCTION))
+    ) {
+        return 0;
+    }
+    Py_INCREF(reduction);
+    if (
+        (type = PyObject_GetAttrString(module, "MessageQueue")) &&
+        (reduce = PyObject_GetAttrString(type, "_reduce"))
+    ) {
+        res = PyObject_CallMethod(reduction, "register", "OO", type, reduce);
+    }
+    Py_XDECREF(reduce);
+    Py_XDECREF(type);
+    Py_DECREF(reduction);
+    if (!res) {
+        return -1;
+    }
+    Py_DECREF(res);
+    state->reducer = 1;
+    return 0;
+}
+
+
+static inline int
+__mq_register_reducer(PyTypeObject *type)
+{
+    PyObject *module = NULL;
+
+    // only the types of this module
+    if (!(module = PyType_GetModule(type))) {
+        PyErr_Clear();
+        return 0;
+    }
+    return _mqueue_register_reducer(module);
+}
+
+
+static inline MessageQueue *
+__mq_new(PyTypeObject *type)
+{
+    MessageQueue *self = NULL;
+
+    if (__mq_register_reducer(type)) {
+        return NULL;
+    }
+    if ((self = PyObject_GC_NEW(MessageQueue, type))) {
+        self->name = NULL;
+        self->flags = 0;
+        self->mode = S_IRUSR | S_IWUSR; // ReadWrite by owner;
+        self->attr.mq_flags = 0;
+        self->attr.mq_maxmsg = -1;
+        self->attr.mq_msgsize = -1;
+        self->attr.mq_curmsgs = 0;
+        self->mqd = -1;
+        self->owner = 0;
+        self->pid = 0;
+        self->buffer = NULL;
+        self->callback = NULL;
+        self->interp = NULL;
+        self->notified = 0;
+        self->codec = NULL;
+        self->ctx = NULL;
+        self->enc = NULL;
+        pthread_mutex_init(&self->send_lock, NULL);
+        pthread_mutex_init(&self->receive_lock, NULL);
+        self->spool = NULL;
+        __mq_link(self);
+        PyObject_GC_Track(self);
+    }
+    return self;
+}
+
+
+/* sets up the queue once self->mqd is open */
+static inline int
+__mq_attach(MessageQueue *self)
+{
+    struct stat st = { 0 };
+
+    self->pid = getpid();
+    if (fstat(self->mqd, &st)) {
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+    self->mode = st.st_mode;
+
+    if (mq_getattr(self->mqd, &self->attr)) {
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+
+    if (!(self->buffer = __mq_buffer_new(self->attr.mq_msgsize))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (self->codec) {
+        if (self->attr.mq_msgsize < 2) {
+            PyErr_Format(
+                PyExc_ValueError,
+                "message size (%ld) too small for codec '%s'",
+                self->attr.mq_msgsize,
+                self->codec->name
+            );
+            return -1;
+        }
+        if (
+            !(self->ctx = self->codec->new()) ||
+            !(self->enc = PyMem_RawMalloc(self->attr.mq_msgsize))
+        ) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static inline int
+__mq_open(MessageQueue *self, const char *codec)
+{
+    module_state *state = NULL;
+    unsigned long bytes = 0;
+    const char *name = NULL;
+
+    if (
+        !(state = __PyObject_GetState__((PyObject *)self)) ||
+        (codec && !(self->codec = _mqueue_get_codec(codec))) ||
+        _mqueue_check_attr(state, &self->attr)
+    ) {
+        return -1;
+    }
+
+    /*
+        the error given by linux in case of overflow is not obvious (EMFILE).
+        unfortunately the 96 is platform dependent but it relies on size of
+        stucts that are not exposed (though it seems accurate on x86_64).
+    */
+    bytes = (96 + self->attr.mq_msgsize) * self->attr.mq_maxmsg;
+    if (bytes > state->max_bytes) {
+        PyErr_Format(
+            PyExc_OverflowError,
+            "message queue total size (%lu) exceeds 'RLIMIT_MSGQUEUE' (%lu)",
+            bytes,
+            state->max_bytes
+        );
+        return -1;
+    }
+
+    name = PyBytes_AS_STRING(self->name);
+    if ((self->flags & O_CREAT)) {
+        int flags = self->flags | O_EXCL;
+        int saved_errno = errno;
+        if (((self->mqd = mq_open(name, flags, self->mode, &self->attr)) == -1)) {
+            if ((flags != self->flags) && (errno == EEXIST)) {
+                errno = saved_errno;
+                self->mqd = mq_open(name, self->flags, self->mode, &self->attr);
+            }
+        }
+        else {
+            self->owner = 1;
+        }
+    }
+    else {
+        self->mqd = mq_open(name, self->flags, self->mode, &self->attr);
+    }
+    if (self->mqd == -1) {
+        switch (errno) {
+            case EACCES:
+            case EEXIST:
+            case ENAMETOOLONG:
+            case ENOENT:
+                _PyErr_SetFromErrnoWithFilename(name);
+                break;
+            default:
+                _PyErr_SetFromErrno();
+                break;
+        }
+        return -1;
+    }
+    return __mq_attach(self);
+}
+
+
+static inline int
+__mq_init(MessageQueue *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {
+        "name", "flags", "mode", "maxmsg", "msgsize", "codec", NULL
+    };
+    const char *codec = NULL;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "O&i|Illz:__new__", kwlist,
+            PyUnicode_FSConverter, &self->name,
+            &self->flags, &self->mode,
+            &self->attr.mq_maxmsg, &self->attr.mq_msgsize,
+            &codec
+        )
+    ) {
+        return -1;
+    }
+    return __mq_open(self, codec);
+}
+
+
+/* takes ownership of fd */
+static MessageQueue *
+__mq_from_fd(PyTypeObject *type, int fd, const char *codec)
+{
+    MessageQueue *self = NULL;
+    char path[32], name[PATH_MAX];
+    Py_ssize_t len = -1;
+    int flags = 0, fdflags = 0;
+
+    if (!(self = __mq_new(type))) {
+        close(fd);
+        return NULL;
+    }
+    self->mqd = fd;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    if (
+        ((len = readlink(path, name, (sizeof(name) - 1))) < 0) ||
+        ((flags = fcntl(fd, F_GETFL)) < 0) ||
+        ((fdflags = fcntl(fd, F_GETFD)) < 0)
+    ) {
+        _PyErr_SetFromErrno();
+        Py_DECREF(self);
+        return NULL;
+    }
+    name[len] = '\0';
+    // already unlinked
+    if ((len > 10) && !strcmp((name + len - 10), " (deleted)")) {
+        name[(len -= 10)] = '\0';
+    }
+    self->flags = flags & (O_ACCMODE | O_NONBLOCK);
+    if (fdflags & FD_CLOEXEC) {
+        self->flags |= O_CLOEXEC;
+    }
+    if (
+        !(self->name = PyBytes_FromStringAndSize(name, len)) ||
+        (codec && !(self->codec = _mqueue_get_codec(codec))) ||
+        __mq_attach(self)
+    ) {
+        Py_CLEAR(self);
+    }
+    return self;
+}
+
+
+static int
+__mq_set_notified(MessageQueue *self, int notified)
+{
+    struct stat st = { 0 };
+
+    if (self->notified) {
+        _mqueue_notified_remove(self->notified);
+        self->notified = 0;
+    }
+    if (notified) {
+        if (fstat(self->mqd, &st) || _mqueue_notified_add(st.st_ino)) {
+            _PyErr_SetFromErrno();
+            return -1;
+        }
+        self->notified = st.st_ino;
+    }
+    return 0;
+}
+
+
+static inline int
+__mq_close(MessageQueue *self)
+{
+    const char *name = (self->name) ? PyBytes_AS_STRING(self->name) : NULL;
+    int res = 0;
+
+    if (self->spool) {
+        _mqueue_spool_free(self->spool);
+        self->spool = NULL;
+    }
+    if (self->mqd != -1) {
+        // closing it cancels any registration
+        if (self->notified && __mq_set_notified(self, 0)) {
+            return -1;
+        }
+        if ((res = mq_close(self->mqd))) {
+            _PyErr_SetFromErrno();
+        }
+        else if (
+            self->owner &&
+            (self->pid == getpid()) &&
+            (res = mq_unlink(name))
+        ) {
+            _PyErr_SetFromErrnoWithFilename(name);
+        }
+        self->mqd = -1;
+    }
+    return res;
+}
+
+
+static inline int
+__mq_getblocking(MessageQueue *self)
+{
+    return ((self->attr.mq_flags & O_NONBLOCK) == 0);
+}
+
+static inline int
+__mq_setblocking(MessageQueue *self, int blocking)
+{
+    struct mq_attr attr = { 0 };
+
+    if (blocking != __mq_getblocking(self)) {
+        attr.mq_flags = (blocking) ? 0 : O_NONBLOCK;
+        if (mq_setattr(self->mqd, &attr, NULL)) {
+            _PyErr_SetFromErrno();
+            return -1;
+        }
+        self->attr.mq_flags = attr.mq_flags;
+        // should we?
+        if (blocking) {
+            self->flags &= ~O_NONBLOCK;
+        }
+        else {
+            self->flags |= O_NONBLOCK;
+        }
+    }
+    return 0;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static inline int
+_mq_send(MessageQueue *self, const char *buf, size_t size,
+         unsigned int priority, const struct timespec *abstime)
+{
+    // never blocks (an inherited spool is left to the parent process)
+    if (self->spool && (self->spool->pid == getpid())) {
+        return __spool_send(self->spool, buf, size, priority);
+    }
+    if (abstime) {
+        return mq_timedsend(self->mqd, buf, size, priority, abstime);
+    }
+    return mq_send(self->mqd, buf, size, priority);
+}
+
+
+/* locks one of the per-queue locks (with the GIL released) */
+static inline int
+__mq_lock(pthread_mutex_t *lock, const struct timespec *abstime)
+{
+    int res = 0;
+
+    if (
+        (res = (abstime) ? pthread_mutex_timedlock(lock, abstime) :
+                           pthread_mutex_lock(lock))
+    ) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* compresses window bytes into self->enc, returns the compressed size or 0 if
+   the result is not smaller than window (or does not fit in 1 message) */
+static inline size_t
+__mq_compress(MessageQueue *self, const mqueue_iter *src, Py_ssize_t window)
+{
+    Py_ssize_t payload = self->attr.mq_msgsize - 1;
+
+    return self->codec->compress(self->ctx, src, window, (self->enc + 1),
+                                 Py_MIN(payload, (window - 1)));
+}
+
+
+/* encodes 1 message into self->enc, returns the number of bytes consumed
+   (src is left as is) */
+static Py_ssize_t
+__mq_encode(MessageQueue *self, const mqueue_iter *src, Py_ssize_t len,
+            int all, Py_ssize_t *size)
+{
+    mqueue_iter iter = *src;
+    Py_ssize_t payload = self->attr.mq_msgsize - 1, window = len, first = 0;
+    Py_ssize_t limit = Py_MIN(len, (payload * MQUEUE_CODEC_MAX_RATIO));
+    size_t csize = 0;
+
+    if (len >= MQUEUE_CODEC_MIN_SIZE) {
+        window = (all) ? Py_MIN(limit, payload) : limit;
+        if ((csize = __mq_compress(self, src, window)) && all &&
+            (window < limit)) {
+            // it shrinks, try a bigger window sized after the compression
+            // ratio (halving it until it fits), else go back to the first one
+            first = window;
+            window = Py_MIN(limit, ((first * payload) / (Py_ssize_t)csize));
+            while (
+                (window > first) &&
+                !(csize = __mq_compress(self, src, window))
+            ) {
+                window >>= 1;
+            }
+            if (!csize) {
+                window = first;
+                csize = __mq_compress(self, src, window);
+            }
+        }
+        if (csize) {
+            self->enc[0] = self->codec->id;
+            *size = csize + 1;
+            return window;
+        }
+    }
+    // not worth it, send it raw
+    window = Py_MIN(len, payload);
+    self->enc[0] = MQUEUE_CODEC_RAW;
+    __iter_gather(&iter, (self->enc + 1), window);
+    *size = window + 1;
+    return window;
+}
+
+
+/* gathers size bytes into self->enc (allocated on first use when there is no
+   codec) */
+static inline int
+__mq_gather(MessageQueue *self, const mqueue_iter *src, Py_ssize_t size)
+{
+    mqueue_iter iter = *src;
+
+    if (!self->enc && !(self->enc = PyMem_RawMalloc(self->attr.mq_msgsize))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    __iter_gather(&iter, self->enc, size);
+    return 0;
+}
+
+
+/* sends 1 message from src, returns the number of bytes consumed (src is
+   advanced past them) */
+static Py_ssize_t
+_mq_send_iter(MessageQueue *self, mqueue_iter *src, Py_ssize_t len,
+              unsigned int priority, int all, const struct timespec *abstime)
+{
+    Py_ssize_t size = 0, res = -1;
+    const char *buf = NULL;
+
+    if (!self->codec) {
+        size = Py_MIN(len, self->attr.mq_msgsize);
+        if ((buf = __iter_contiguous(src, size))) {
+            res = (_mq_send(self, buf, size, priority, abstime)) ? -1 : size;
+        }
+        else {
+            // gathered under send_lock, self->enc is reused
+            if (__mq_lock(&self->send_lock, abstime)) {
+                return -1;
+            }
+            if (
+                !__mq_gather(self, src, size) &&
+                !_mq_send(self, self->enc, size, priority, abstime)
+            ) {
+                res = size;
+            }
+            pthread_mutex_unlock(&self->send_lock);
+        }
+    }
+    else {
+        if (__mq_lock(&self->send_lock, abstime)) {
+            return -1;
+        }
+        if (
+            ((res = __mq_encode(self, src, len, all, &size)) >= 0) &&
+            _mq_send(self, self->enc, size, priority, abstime)
+        ) {
+            res = -1;
+        }
+        pthread_mutex_unlock(&self->send_lock);
+    }
+    if (res > 0) {
+        __iter_skip(src, res);
+    }
+    return res;
+}
+
+
+/* sends 1 message, returns the number of bytes consumed from buf */
+static Py_ssize_t
+_mq_send_msg(MessageQueue *self, const char *buf, Py_ssize_t len,
+             unsigned int priority, int all, const struct timespec *abstime)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    mqueue_iter iter;
+
+    __iter_init(&iter, &iov, 1);
+    return _mq_send_iter(self, &iter, len, priority, all, abstime);
+}
+
+
+static inline Py_ssize_t
+__mq_send_msg(MessageQueue *self, const char *buf, Py_ssize_t len,
+              unsigned int priority, int all)
+{
+    Py_ssize_t res = -1;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = _mq_send_msg(self, buf, len, priority, all, NULL);
+    Py_END_ALLOW_THREADS
+    return res;
+}
+
+
+/* the largest message receive() can return */
+static inline size_t
+__mq_maxsize(MessageQueue *self)
+{
+    if (self->codec) {
+        return (self->attr.mq_msgsize - 1) * MQUEUE_CODEC_MAX_RATIO;
+    }
+    return self->attr.mq_msgsize;
+}
+
+
+/* decodes 1 message from msg (decompressing into *dst, grown up to max
+   bytes), returns the size of *data */
+static Py_ssize_t
+__mq_decode(MessageQueue *self, const char *msg, Py_ssize_t size,
+            const char **data, char **dst, size_t *dsize, size_t max)
+{
+    *data = msg;
+    if (!self->codec || !size) {
+        return size;
+    }
+    if (msg[0] == MQUEUE_CODEC_RAW) {
+        *data = (msg + 1);
+        return (size - 1);
+    }
+    if ((unsigned char)msg[0] == self->codec->id) {
+        pthread_mutex_lock(&self->receive_lock);
+        size = self->codec->decompress(self->ctx, (msg + 1), (size - 1), dst,
+                                       dsize, max);
+        pthread_mutex_unlock(&self->receive_lock);
+        if (size >= 0) {
+            *data = *dst;
+        }
+        return size;
+    }
+    errno = EBADMSG;
+    return -1;
+}
+
+
+/* receives 1 message into msg */
+static inline Py_ssize_t
+__mq_timedreceive(MessageQueue *self, char *msg, unsigned int *priority,
+                  const struct timespec *abstime)
+{
+    if (abstime) {
+        return mq_timedreceive(self->mqd, msg, self->attr.mq_msgsize,
+                               priority, abstime);
+    }
+    return mq_receive(self->mqd, msg, self->attr.mq_msgsize, priority);
+}
+
+
+/* receives 1 message, returns the size of *data.
+   On success, *data lives in *buffer until _mq_release() is called */
+static Py_ssize_t
+_mq_receive(MessageQueue *self, mqueue_buffer **buffer, const char **data,
+            unsigned int *priority, const struct timespec *abstime)
+{
+    mqueue_buffer *b = NULL;
+    Py_ssize_t size = -1;
+
+    if (!(b = __mq_buffer_get(self))) {
+        return -1;
+    }
+    if (
+        ((size = __mq_timedreceive(self, b->msg, priority, abstime)) < 0) ||
+        ((size = __mq_decode(self, b->msg, size, data, &b->dec, &b->decsize,
+                             __mq_maxsize(self))) < 0)
+    ) {
+        __mq_buffer_put(self, b);
+        return -1;
+    }
+    *buffer = b;
+    return size;
+}
+
+
+static inline void
+_mq_release(MessageQueue *self, mqueue_buffer *buffer)
+{
+    __mq_buffer_put(self, buffer);
+}
+
+
+static inline Py_ssize_t
+__mq_receive(MessageQueue *self, mqueue_buffer **buffer, const char **data)
+{
+    Py_ssize_t size = -1;
+
+    Py_BEGIN_ALLOW_THREADS
+    size = _mq_receive(self, buffer, data, NULL, NULL);
+    Py_END_ALLOW_THREADS
+    return size;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+/* streams count bytes (everything up to EOF if count < 0) from fd, reading
+   at offset + *total, or from the current file offset if offset < 0.
+   Resumable (EINTR): *total (bytes sent) and *pending (bytes read into chunk
+   but not sent yet) carry over from one call to the next.
+   Returns 0 or -1 (errno) */
+static int
+_mq_send_file(MessageQueue *self, int fd, off_t offset, Py_ssize_t count,
+              unsigned int priority, char *chunk, Py_ssize_t chunksize,
+              Py_ssize_t *total, Py_ssize_t *pending)
+{
+    Py_ssize_t len = 0, size = 0;
+
+    for (;;) {
+        if (!*pending) {
+            if ((count >= 0) && (*total >= count)) {
+                break;
+            }
+            len = (count < 0) ? chunksize : Py_MIN(chunksize, (count - *total));
+            if (offset < 0) {
+                len = read(fd, chunk, len);
+            }
+            else {
+                len = pread(fd, chunk, len, (offset + *total));
+            }
+            if (len < 0) {
+                return -1;
+            }
+            if (!len) {
+                break;
+            }
+            *pending = len;
+        }
+        if ((size = _mq_send_msg(self, chunk, *pending, priority, 1, NULL)) < 0) {
+            return -1;
+        }
+        memmove(chunk, (chunk + size), (*pending - size));
+        *pending -= size;
+        *total += size;
+    }
+    return 0;
+}
+
+
+/* writes the messages received to fd until an empty one is received or
+   at least stop_after (if >= 0) bytes have been written.
+   Resumable (EINTR): *total (bytes written) carries over from one call to the
+   next. Returns 0 or -1 (errno) */
+static int
+_mq_receive_to_file(MessageQueue *self, int fd, Py_ssize_t stop_after,
+                    Py_ssize_t *total)
+{
+    mqueue_buffer *buffer = NULL;
+    Py_ssize_t len = 0, size = 0;
+    const char *data = NULL;
+    int res = 0;
+
+    while (!res && ((stop_after < 0) || (*total < stop_after))) {
+        if ((size = _mq_receive(self, &buffer, &data, NULL, NULL)) < 0) {
+            return -1;
+        }
+        if (!size) {
+            _mq_release(self, buffer);
+            break;
+        }
+        while (size > 0) {
+            if ((len = write(fd, data, size)) < 0) {
+                if (errno == EINTR) {
+                    continue; // the message is already dequeued
+                }
+                res = -1;
+                break;
+            }
+            data += len;
+            size -= len;
+            *total += len;
+        }
+        _mq_release(self, buffer);
+    }
+    return res;
+}
+
+
+/* MessageQueue_Type -------------------------------------------------------- */
+
+/* MessageQueue_Type.tp_new */
+static PyObject *
+MessageQueue_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    MessageQueue *self = NULL;
+
+    if ((self = __mq_new(type)) && __mq_init(self, args, kwargs)) {
+        Py_CLEAR(self);
+    }
+    return (PyObject *)self;
+}
+
+
+/* MessageQueue_Type.tp_traverse */
+static int
+MessageQueue_tp_traverse(MessageQueue *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->callback);
+    Py_VISIT(self->name);
+    Py_VISIT(Py_TYPE(self)); // heap type
+    return 0;
+}
+
+
+/* MessageQueue_Type.tp_finalize */
+static void
+MessageQueue_tp_finalize(MessageQueue *self)
+{
+    PyObject *exc_type, *exc_value, *exc_traceback;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_traceback);
+    if (__mq_close(self)) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+    PyErr_Restore(exc_type, exc_value, exc_traceback);
+}
+
+
+/* MessageQueue_Type.tp_clear */
+static int
+MessageQueue_tp_clear(MessageQueue *self)
+{
+    Py_CLEAR(self->callback);
+    Py_CLEAR(self->name);
+    return 0;
+}
+
+
+/* MessageQueue_Type.tp_dealloc */
+static void
+MessageQueue_tp_dealloc(MessageQueue *self)
+{
+    if (PyObject_CallFinalizerFromDealloc((PyObject *)self)) {
+        return;
+    }
+    PyObject_GC_UnTrack(self);
+    __mq_buffer_free(self->buffer);
+    self->buffer = NULL;
+    if (self->ctx) {
+        self->codec->free(self->ctx);
+        self->ctx = NULL;
+    }
+    PyMem_RawFree(self->enc);
+    self->enc = NULL;
+    __mq_unlink(self);
+    pthread_mutex_destroy(&self->receive_lock);
+    pthread_mutex_destroy(&self->send_lock);
+    MessageQueue_tp_clear(self);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* MessageQueue_Type.tp_repr */
+static PyObject *
+MessageQueue_tp_repr(MessageQueue *self)
+{
+    PyObject *result = NULL, *name = NULL;
+
+    if ((name = PyUnicode_DecodeFSDefault(PyBytes_AS_STRING(self->name)))) {
+        result = PyUnicode_FromFormat(
+            "<%s('%U', %d, mode=%u, maxmsg=%ld, msgsize=%ld)>",
+            Py_TYPE(self)->tp_name, name, self->flags, self->mode,
+            self->attr.mq_maxmsg, self->attr.mq_msgsize
+        );
+        Py_DECREF(name);
+    }
+    return result;
+}
+
+
+/* len() */
+static Py_ssize_t
+MessageQueue_sq_length(MessageQueue *self)
+{
+    if (mq_getattr(self->mqd, &self->attr)) {
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+    return self->attr.mq_curmsgs;
+}
+
+
+/* MessageQueue.close() */
+PyDoc_STRVAR(MessageQueue_close_doc,
+"close()");
+
+static PyObject *
+MessageQueue_close(MessageQueue *self)
+{
+    return (__mq_close(self)) ? NULL : Py_NewRef(Py_None);
+}
+
+
+/* MessageQueue.fileno() */
+PyDoc_STRVAR(MessageQueue_fileno_doc,
+"fileno() -> int\n\
+Returns the underlying file descriptor.");
+
+static PyObject *
+MessageQueue_fileno(MessageQueue *self)
+{
+    return PyLong_FromLong(self->mqd);
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static int
+__mq_check_handle(PyTypeObject *type)
+{
+    if (type->tp_new != MessageQueue_tp_new) {
+        PyErr_Format(PyExc_TypeError,
+                     "%.200s objects can not be created from a handle",
+                     type->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* MessageQueue.from_fd(fd[, codec]) */
+PyDoc_STRVAR(MessageQueue_from_fd_doc,
+"from_fd(fd[, codec=None]) -> MessageQueue\n\
+Returns a MessageQueue using a duplicate of the message queue descriptor fd.");
+
+static PyObject *
+MessageQueue_from_fd(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"fd", "codec", NULL};
+    int fd = -1;
+    const char *codec = NULL;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(args, kwargs, "i|z:from_fd", kwlist,
+                                     &fd, &codec) ||
+        __mq_check_handle(type)
+    ) {
+        return NULL;
+    }
+    if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        return _PyErr_SetFromErrno();
+    }
+    return (PyObject *)__mq_from_fd(type, fd, codec);
+}
+
+
+/* MessageQueue._rebuild(handle[, codec]) (multiprocessing) */
+static PyObject *
+MessageQueue__rebuild(PyTypeObject *type, PyObject *args)
+{
+    PyObject *handle = NULL, *detached = NULL;
+    const char *codec = NULL;
+    int fd = -1;
+
+    if (
+        !PyArg_ParseTuple(args, "O|z:_rebuild", &handle, &codec) ||
+        !(detached = PyObject_CallMethod(handle, "detach", NULL))
+    ) {
+        return NULL;
+    }
+    fd = (int)PyLong_AsLong(detached);
+    Py_DECREF(detached);
+    if ((fd == -1) && PyErr_Occurred()) {
+        return NULL;
+    }
+    return (PyObject *)__mq_from_fd(type, fd, codec);
+}
+
+
+/* MessageQueue._reduce() (multiprocessing) */
+static PyObject *
+MessageQueue__reduce(MessageQueue *self)
+{
+    PyObject *reduction = NULL, *handle = NULL, *rebuild = NULL;
+    PyObject *result = NULL;
+
+    if (__mq_check_handle(Py_TYPE(self))) {
+        return NULL;
+    }
+    if (self->mqd == -1) {
+        PyErr_SetString(PyExc_ValueError, "can not pickle a closed queue");
+        return NULL;
+    }
+    // the descriptor is passed to the other process (inherited when spawning
+    // it, or sent with SCM_RIGHTS afterwards), not the name
+    if ((reduction = PyImport_ImportModule(MQUEUE_REDUCTION))) {
+        if (
+            (handle = PyObject_CallMethod(reduction, "DupFd", "i", self->mqd)) &&
+            (rebuild = PyObject_GetAttrString((PyObject *)Py_TYPE(self),
+                                              "_rebuild"))
+        ) {
+            result = Py_BuildValue("O(Oz)", rebuild, handle,
+                                   (self->codec) ? self->codec->name : NULL);
+        }
+        Py_XDECREF(rebuild);
+        Py_XDECREF(handle);
+        Py_DECREF(reduction);
+    }
+    return result;
+}
+
+
+/* MessageQueue.__reduce__() */
+static PyObject *
+MessageQueue___reduce__(MessageQueue *self)
+{
+    // only multiprocessing knows how to pass the descriptor along (if it was
+    // imported after this queue was created, from now on)
+    if (__mq_register_reducer(Py_TYPE(self))) {
+        return NULL;
+    }
+    PyErr_Format(PyExc_TypeError, "cannot pickle '%.200s' object",
+                 Py_TYPE(self)->tp_name);
+    return NULL;
+}
+
+
+/* MessageQueue.send(msg[, priority]) */
+PyDoc_STRVAR(MessageQueue_send_doc,
+"send(msg[, priority]) -> int\n\
+Sends 1 message. Returns the number of bytes sent.");
+
+static PyObject *
+MessageQueue_send(MessageQueue *self, PyObject *args)
+{
+    Py_buffer msg;
+    unsigned int priority = 0;
+    Py_ssize_t size = 0;
+
+    if (!PyArg_ParseTuple(args, "y*|I:send", &msg, &priority)) {
+        return NULL;
+    }
+    if ((size = __mq_send_msg(self, msg.buf, msg.len, priority, 0)) < 0) {
+        PyBuffer_Release(&msg);
+        return _PyErr_SetFromErrno();
+    }
+    PyBuffer_Release(&msg);
+    return PyLong_FromSsize_t(size);
+}
+
+
+/* MessageQueue.sendall(msg[, priority]) */
+PyDoc_STRVAR(MessageQueue_sendall_doc,
+"sendall(msg[, priority])\n\
+Sends 1 message. This calls send() repeatedly until all data is sent.");
+
+static PyObject *
+MessageQueue_sendall(MessageQueue *self, PyObject *args)
+{
+    Py_buffer msg;
+    unsigned int priority = 0;
+    Py_ssize_t size = 0;
+    const char *buf = NULL;
+    Py_ssize_t len = 0;
+
+    if (!PyArg_ParseTuple(args, "y*|I:sendall", &msg, &priority)) {
+        return NULL;
+    }
+    buf = msg.buf;
+    len = msg.len;
+    do {
+        if ((size = __mq_send_msg(self, buf, len, priority, 1)) < 0) {
+            PyBuffer_Release(&msg);
+            return _PyErr_SetFromErrno();
+        }
+        buf += size;
+        len -= size;
+    } while (len > 0);
+    PyBuffer_Release(&msg);
+    Py_RETURN_NONE;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static void
+__mq_releasebuffers(Py_buffer *views, Py_ssize_t count)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < count; ++i) {
+        PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+}
+
+
+/* non-contiguous buffers are copied, *iov points to their data (it is
+   allocated along with *views), returns the total size or -1 */
+static Py_ssize_t
+__mq_getbuffers(PyObject *buffers, Py_buffer **views, struct iovec **iov,
+                Py_ssize_t *count)
+{
+    PyObject *seq = NULL, *item = NULL, *contiguous = NULL;
+    Py_ssize_t i, n = 0, len = 0;
+    int res = 0;
+
+    if (!(seq = PySequence_Fast(buffers, "a sequence of buffers is required"))) {
+        return -1;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (
+        !(*views = PyMem_Calloc(Py_MAX(n, 1),
+                                (sizeof(Py_buffer) + sizeof(struct iovec))))
+    ) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    *iov = (struct iovec *)(*views + Py_MAX(n, 1));
+    for (i = 0; i < n; ++i) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if ((res = PyObject_GetBuffer(item, &(*views)[i], PyBUF_SIMPLE))) {
+            if (!PyErr_ExceptionMatches(PyExc_BufferError)) {
+                break;
+            }
+            PyErr_Clear();
+            if ((contiguous = PyMemoryView_GetContiguous(item, PyBUF_READ, 'C'))) {
+                res = PyObject_GetBuffer(contiguous, &(*views)[i], PyBUF_SIMPLE);
+                Py_DECREF(contiguous);
+            }
+            if (!contiguous || res) {
+                res = -1;
+                break;
+            }
+        }
+        (*iov)[i].iov_base = (*views)[i].buf;
+        (*iov)[i].iov_len = (*views)[i].len;
+        len += (*views)[i].len;
+    }
+    Py_DECREF(seq);
+    if (res) {
+        __mq_releasebuffers(*views, i);
+        return -1;
+    }
+    *count = n;
+    return len;
+}
+
+
+/* MessageQueue.sendv(buffers[, priority]) */
+PyDoc_STRVAR(MessageQueue_sendv_doc,
+"sendv(buffers[, priority]) -> int\n\
+Sends 1 message gathered from buffers. Returns the number of bytes sent.");
+
+static PyObject *
+MessageQueue_sendv(MessageQueue *self, PyObject *args)
+{
+    PyObject *buffers = NULL;
+    unsigned int priority = 0;
+    Py_buffer *views = NULL;
+    struct iovec *iov = NULL;
+    Py_ssize_t count = 0, len = 0;
+    mqueue_iter iter;
+
+    if (
+        !PyArg_ParseTuple(args, "O|I:sendv", &buffers, &priority) ||
+        ((len = __mq_getbuffers(buffers, &views, &iov, &count)) < 0)
+    ) {
+        return NULL;
+    }
+    // encoded (or gathered) straight from the buffers
+    __iter_init(&iter, iov, count);
+    len = Py_MIN(len, (Py_ssize_t)__mq_maxsize(self));
+    Py_BEGIN_ALLOW_THREADS
+    len = _mq_send_iter(self, &iter, len, priority, 0, NULL);
+    Py_END_ALLOW_THREADS
+    __mq_releasebuffers(views, count);
+    if (len < 0) {
+        return _PyErr_SetFromErrno();
+    }
+    return PyLong_FromSsize_t(len);
+}
+
+
+/* MessageQueue.sendallv(buffers[, priority]) */
+PyDoc_STRVAR(MessageQueue_sendallv_doc,
+"sendallv(buffers[, priority])\n\
+Sends the data gathered from buffers, in as many messages as needed.");
+
+static PyObject *
+MessageQueue_sendallv(MessageQueue *self, PyObject *args)
+{
+    PyObject *buffers = NULL;
+    unsigned int priority = 0;
+    Py_buffer *views = NULL;
+    struct iovec *iov = NULL;
+    Py_ssize_t count = 0, len = 0, size = 0;
+    mqueue_iter iter;
+
+    if (
+        !PyArg_ParseTuple(args, "O|I:sendallv", &buffers, &priority) ||
+        ((len = __mq_getbuffers(buffers, &views, &iov, &count)) < 0)
+    ) {
+        return NULL;
+    }
+    // encoded (or gathered) straight from the buffers, 1 message at a time,
+    // like sendall(), no data still means 1 (empty) message
+    __iter_init(&iter, iov, count);
+    Py_BEGIN_ALLOW_THREADS
+    do {
+        if ((size = _mq_send_iter(self, &iter, len, priority, 1, NULL)) < 0) {
+            break;
+        }
+        len -= size;
+    } while (len > 0);
+    Py_END_ALLOW_THREADS
+    __mq_releasebuffers(views, count);
+    if (size < 0) {
+        return _PyErr_SetFromErrno();
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* MessageQueue.receive() */
+PyDoc_STRVAR(MessageQueue_receive_doc,
+"receive() -> bytes\n\
+Receives 1 message.");
+
+static PyObject *
+MessageQueue_receive(MessageQueue *self)
+{
+    PyObject *result = NULL;
+    mqueue_buffer *buffer = NULL;
+    const char *data = NULL;
+    Py_ssize_t size = -1;
+
+    if ((size = __mq_receive(self, &buffer, &data)) < 0) {
+        return _PyErr_SetFromErrno();
+    }
+    result = PyBytes_FromStringAndSize(data, size);
+    _mq_release(self, buffer);
+    return result;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static void
+__mq_callback(union sigval sv)
+{
+    MessageQueue *self = (MessageQueue *)sv.sival_ptr;
+    PyThreadState *tstate = NULL;
+    PyObject *callback = NULL, *result = NULL;
+
+    // run in the interpreter that registered the callback,
+    // PyGILState_Ensure() only knows about the main one
+    if (!(tstate = PyThreadState_New(self->interp))) {
+        return;
+    }
+    PyEval_RestoreThread(tstate);
+    // one-shot, the registration is gone (before the callback, which may
+    // register again)
+    callback = self->callback;
+    self->callback = NULL;
+    if (__mq_set_notified(self, 0)) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+    if (callback) {
+        if ((result = PyObject_CallFunctionObjArgs(callback, self, NULL))) {
+            Py_DECREF(result);
+        }
+        else {
+            PyErr_WriteUnraisable(callback);
+        }
+        Py_DECREF(callback);
+    }
+    PyThreadState_Clear(tstate);
+    PyThreadState_DeleteCurrent();
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+/* MessageQueue.notify([callback]) */
+PyDoc_STRVAR(MessageQueue_notify_doc,
+"notify([callback])\n\
+Register or unregister for notification.");
+
+static PyObject *
+MessageQueue_notify(MessageQueue *self, PyObject *args)
+{
+    struct sigevent sev = { .sigev_notify = -1 };
+    struct sigevent *sevp = NULL;
+    PyObject *callback = NULL;
+
+    if (!PyArg_ParseTuple(args, "|O:notify", &callback)) {
+        return NULL;
+    }
+    if (callback) {
+        if (callback == Py_None) {
+            sev.sigev_notify = SIGEV_NONE;
+        }
+        else if (PyLong_Check(callback)) {
+            int signum = _PyLong_AsInt(callback);
+            if (signum == -1 && PyErr_Occurred()) {
+                return NULL;
+            }
+            if (signum < 1 || signum >= NSIG) {
+                PyErr_SetString(PyExc_ValueError, "signal number out of range");
+                return NULL;
+            }
+            sev.sigev_notify = SIGEV_SIGNAL;
+            sev.sigev_signo = signum;
+        }
+        else if (PyCallable_Check(callback)) {
+            sev.sigev_notify = SIGEV_THREAD;
+            sev.sigev_notify_function = __mq_callback;
+            sev.sigev_notify_attributes = NULL;
+            sev.sigev_value.sival_ptr = self;
+            self->interp = PyInterpreterState_Get();
+        }
+        else {
+            PyErr_SetString(
+                PyExc_TypeError,
+                "a callable, a signal number or None is required"
+            );
+            return NULL;
+        }
+        sevp = &sev;
+    }
+    if (mq_notify(self->mqd, sevp)) {
+        return _PyErr_SetFromErrno();
+    }
+    if (__mq_set_notified(self, (sevp != NULL))) {
+        return NULL;
+    }
+    if (sev.sigev_notify == SIGEV_THREAD) {
+        _Py_SET_MEMBER(self->callback, callback);
+    }
+    else {
+        Py_CLEAR(self->callback);
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* MessageQueue.spool([path]) */
+PyDoc_STRVAR(MessageQueue_spool_doc,
+"spool([path])\n\
+Start or stop spooling messages to the journal at path when the queue is full.");
+
+static PyObject *
+MessageQueue_spool(MessageQueue *self, PyObject *args)
+{
+    PyObject *path = NULL;
+    mqueue_spool *spool = NULL;
+
+    if (!PyArg_ParseTuple(args, "|O&:spool", PyUnicode_FSConverter, &path)) {
+        return NULL;
+    }
+    // stop the current one first, it may be the same journal (locked)
+    if ((spool = self->spool)) {
+        self->spool = NULL;
+        _mqueue_spool_free(spool);
+    }
+    if (path) {
+        self->spool = _mqueue_spool_new(PyBytes_AS_STRING(path), self->mqd,
+                                        self->attr.mq_msgsize);
+        Py_DECREF(path);
+        if (!self->spool) {
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+static inline int
+__buf_exported(PyByteArrayObject *buf)
+{
+    if (buf->ob_exports > 0) {
+        PyErr_SetString(
+            PyExc_BufferError,
+            "Existing exports of data: object cannot be re-sized"
+        );
+        return -1;
+    }
+    return 0;
+}
+
+
+static inline void
+__buf_shrink(PyByteArrayObject *buf, Py_ssize_t size)
+{
+    // XXX: very bad shortcut ¯\_(ツ)_/¯
+    Py_SET_SIZE(buf, size);
+    buf->ob_start[size] = '\0';
+}
+
+
+static inline int
+__buf_realloc(PyByteArrayObject *buf, Py_ssize_t nalloc)
+{
+    Py_ssize_t alloc = 0;
+    void *bytes = NULL;
+
+    if (buf->ob_alloc < nalloc) {
+        alloc = Py_MAX(nalloc, (buf->ob_alloc << 1));
+        if (!(bytes = PyObject_Realloc(buf->ob_bytes, alloc))) {
+            return -1;
+        }
+        buf->ob_start = buf->ob_bytes = bytes;
+        buf->ob_alloc = alloc;
+    }
+    return 0;
+}
+
+
+static inline int
+__buf_resize(PyByteArrayObject *buf, size_t size)
+{
+    if ((size >= PY_SSIZE_T_MAX) || __buf_realloc(buf, (size + 1))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+
+static inline int
+__buf_grow(PyByteArrayObject *buf, const char *bytes, size_t size)
+{
+    size_t start = Py_SIZE(buf), nsize = start + size;
+
+    memcpy((buf->ob_bytes + start), bytes, size);
+    Py_SET_SIZE(buf, nsize);
+    buf->ob_bytes[nsize] = '\0';
+    return 0;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+/* MessageQueue.fill(buf[, priority]) */
+PyDoc_STRVAR(MessageQueue_fill_doc,
+"fill(buf[, priority])\n\
+Fills the queue with messages from buf.");
+
+static PyObject *
+MessageQueue_fill(MessageQueue *self, PyObject *args)
+{
+    PyByteArrayObject *buf = NULL;
+    unsigned int priority = 0;
+    Py_ssize_t len, size = 0;
+
+    if (!PyArg_ParseTuple(args, "Y|I:fill", &buf, &priority) ||
+        __buf_exported(buf)) {
+        return NULL;
+    }
+    while ((len = Py_SIZE(buf)) > 0) {
+        if ((size = __mq_send_msg(self, buf->ob_start, len, priority, 1)) < 0) {
+            return _PyErr_SetFromErrno();
+        }
+        // XXX: very bad shortcut ¯\_(ツ)_/¯
+        buf->ob_start += size;
+        __buf_shrink(buf, (len - size));
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* MessageQueue.drain(buf) */
+PyDoc_STRVAR(MessageQueue_drain_doc,
+"drain(buf) -> bool\n\
+Drains all messages from the queue into buf.\n\
+Stops when receiving an empty message.\n\
+Returns whether the last message received was empty.");
+
+static PyObject *
+MessageQueue_drain(MessageQueue *self, PyObject *args)
+{
+    PyByteArrayObject *buf = NULL;
+    long i, len = 0;
+    mqueue_buffer *buffer = NULL;
+    const char *data = NULL;
+    Py_ssize_t size = -1;
+
+    if (!PyArg_ParseTuple(args, "Y:drain", &buf) ||
+        __buf_exported(buf)) {
+        return NULL;
+    }
+    if (mq_getattr(self->mqd, &self->attr)) {
+        return _PyErr_SetFromErrno();
+    }
+    len = self->attr.mq_curmsgs ? self->attr.mq_curmsgs : 1;
+    for (i = 0; i < len; ++i) {
+        if ((size = __mq_receive(self, &buffer, &data)) < 0) {
+            return _PyErr_SetFromErrno();
+        }
+        if (!size) {
+            _mq_release(self, buffer);
+            break;
+        }
+        if ((i == 0 && __buf_resize(buf, (len * self->attr.mq_msgsize))) ||
+            (self->codec && __buf_resize(buf, (Py_SIZE(buf) + size))) ||
+            __buf_grow(buf, data, size)) {
+            _mq_release(self, buffer);
+            return NULL;
+        }
+        _mq_release(self, buffer);
+    }
+    return PyBool_FromLong((size == 0));
+}
+
+
+/* raises the current error (errno if none), with the amount transferred so
+   far attached as name (characters_written for bytes) */
+static PyObject *
+__mq_partial_error(const char *name, Py_ssize_t transferred)
+{
+    PyObject *type = NULL, *value = NULL, *traceback = NULL, *count = NULL;
+
+    if (!PyErr_Occurred()) {
+        _PyErr_SetFromErrno();
+    }
+    if (PyErr_ExceptionMatches(PyExc_OSError)) {
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        if ((count = PyLong_FromSsize_t(transferred))) {
+            if (PyObject_SetAttrString(value, name, count)) {
+                PyErr_Clear();
+            }
+            Py_DECREF(count);
+        }
+        else {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, traceback);
+    }
+    return NULL;
+}
+
+
+/* MessageQueue.send_file(fd[, offset, count, priority, framed]) */
+PyDoc_STRVAR(MessageQueue_send_file_doc,
+"send_file(fd[, offset=-1, count=-1, priority=0, framed=False]) -> int\n\
+Sends count bytes (everything up to EOF if count < 0) read from fd,\n\
+starting at offset (the current file offset if offset < 0).\n\
+If framed is true, an empty message is sent at the end.\n\
+Returns the number of bytes sent (on error, it is the characters_written\n\
+attribute of the exception).");
+
+static PyObject *
+MessageQueue_send_file(MessageQueue *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {
+        "fd", "offset", "count", "priority", "framed", NULL
+    };
+    int fd = -1, framed = 0, seek = 0, res = -1, saved_errno = 0;
+    long long offset = -1;
+    Py_ssize_t count = -1, chunksize = 0, total = 0, pending = 0;
+    unsigned int priority = 0;
+    char *chunk = NULL;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "i|LnIp:send_file", kwlist,
+            &fd, &offset, &count, &priority, &framed
+        )
+    ) {
+        return NULL;
+    }
+    // with a codec, read enough to pack messages like sendall() does
+    chunksize = __mq_maxsize(self);
+    if (!(chunk = PyMem_RawMalloc(chunksize))) {
+        return PyErr_NoMemory();
+    }
+    // if fd is seekable, read at explicit offsets, and only move the file
+    // offset past what was actually sent
+    if ((offset < 0) && ((offset = lseek(fd, 0, SEEK_CUR)) >= 0)) {
+        seek = 1;
+    }
+    do {
+        Py_BEGIN_ALLOW_THREADS
+        if (
+            !(res = _mq_send_file(self, fd, (off_t)offset, count, priority,
+                                  chunk, chunksize, &total, &pending)) &&
+            framed &&
+            // an empty message marks the end of the stream
+            (_mq_send_msg(self, chunk, 0, priority, 1, NULL) < 0)
+        ) {
+            res = -1;
+        }
+        Py_END_ALLOW_THREADS
+    } while (res && (errno == EINTR) && !PyErr_CheckSignals());
+    saved_errno = errno;
+    if (seek) {
+        lseek(fd, (offset + total), SEEK_SET);
+    }
+    PyMem_RawFree(chunk);
+    if (res) {
+        errno = saved_errno;
+        return __mq_partial_error("characters_written", total);
+    }
+    return PyLong_FromSsize_t(total);
+}
+
+
+/* MessageQueue.receive_to_file(fd[, stop_after]) */
+PyDoc_STRVAR(MessageQueue_receive_to_file_doc,
+"receive_to_file(fd[, stop_after=-1]) -> int\n\
+Writes the messages received to fd.\n\
+Stops when receiving an empty message, or once at least stop_after\n\
+(if >= 0) bytes have been written (messages are never split).\n\
+Returns the number of bytes written (on error, it is the\n\
+characters_written attribute of the exception).");
+
+static PyObject *
+MessageQueue_receive_to_file(MessageQueue *self, PyObject *args,
+                             PyObject *kwargs)
+{
+    static char *kwlist[] = {"fd", "stop_after", NULL};
+    int fd = -1, res = -1;
+    Py_ssize_t stop_after = -1, total = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(args, kwargs, "i|n:receive_to_file",
+                                     kwlist, &fd, &stop_after)
+    ) {
+        return NULL;
+    }
+    do {
+        Py_BEGIN_ALLOW_THREADS
+        res = _mq_receive_to_file(self, fd, stop_after, &total);
+        Py_END_ALLOW_THREADS
+    } while (res && (errno == EINTR) && !PyErr_CheckSignals());
+    if (res) {
+        return __mq_partial_error("characters_written", total);
+    }
+    return PyLong_FromSsize_t(total);
+}
+
+
+/* MessageQueue_Type.tp_methods */
+static PyMethodDef MessageQueue_tp_methods[] = {
+    {
+        "close", (PyCFunction)MessageQueue_close,
+        METH_NOARGS, MessageQueue_close_doc
+    },
+    {
+        "fileno", (PyCFunction)MessageQueue_fileno,
+        METH_NOARGS, MessageQueue_fileno_doc
+    },
+    {
+        "from_fd", (PyCFunction)MessageQueue_from_fd,
+        METH_VARARGS | METH_KEYWORDS | METH_CLASS, MessageQueue_from_fd_doc
+    },
+    {
+        "_rebuild", (PyCFunction)MessageQueue__rebuild,
+        METH_VARARGS | METH_CLASS, NULL
+    },
+    {
+        "_reduce", (PyCFunction)MessageQueue__reduce,
+        METH_NOARGS, NULL
+    },
+    {
+        "__reduce__", (PyCFunction)MessageQueue___reduce__,
+        METH_NOARGS, NULL
+    },
+    {
+        "send", (PyCFunction)MessageQueue_send,
+        METH_VARARGS, MessageQueue_send_doc
+    },
+    {
+        "sendall", (PyCFunction)MessageQueue_sendall,
+        METH_VARARGS, MessageQueue_sendall_doc
+    },
+    {
+        "sendv", (PyCFunction)MessageQueue_sendv,
+        METH_VARARGS, MessageQueue_sendv_doc
+    },
+    {
+        "sendallv", (PyCFunction)MessageQueue_sendallv,
+        METH_VARARGS, MessageQueue_sendallv_doc
+    },
+    {
+        "receive", (PyCFunction)MessageQueue_receive,
+        METH_NOARGS, MessageQueue_receive_doc
+    },
+    {
+        "notify", (PyCFunction)MessageQueue_notify,
+        METH_VARARGS, MessageQueue_notify_doc
+    },
+    {
+        "spool", (PyCFunction)MessageQueue_spool,
+        METH_VARARGS, MessageQueue_spool_doc
+    },
+    {
+        "fill", (PyCFunction)MessageQueue_fill,
+        METH_VARARGS, MessageQueue_fill_doc
+    },
+    {
+        "drain", (PyCFunction)MessageQueue_drain,
+        METH_VARARGS, MessageQueue_drain_doc
+    },
+    {
+        "send_file", (PyCFunction)MessageQueue_send_file,
+        METH_VARARGS | METH_KEYWORDS, MessageQueue_send_file_doc
+    },
+    {
+        "receive_to_file", (PyCFunction)MessageQueue_receive_to_file,
+        METH_VARARGS | METH_KEYWORDS, MessageQueue_receive_to_file_doc
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+/* MessageQueue_Type.tp_members */
+static PyMemberDef MessageQueue_tp_members[] = {
+    {
+        "flags", T_INT, offsetof(MessageQueue, flags),
+        READONLY, NULL
+    },
+    {
+        "mode", T_UINT, offsetof(MessageQueue, mode),
+        READONLY, NULL
+    },
+    {
+        "maxmsg", T_LONG, offsetof(MessageQueue, attr.mq_maxmsg),
+        READONLY, NULL
+    },
+    {
+        "msgsize", T_LONG, offsetof(MessageQueue, attr.mq_msgsize),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+/* MessageQueue.name */
+static PyObject *
+MessageQueue_name_get(MessageQueue *self, void *closure)
+{
+    return PyUnicode_DecodeFSDefault(PyBytes_AS_STRING(self->name));
+}
+
+
+/* MessageQueue.closed */
+static PyObject *
+MessageQueue_closed_get(MessageQueue *self, void *closure)
+{
+    return PyBool_FromLong((self->mqd == -1));
+}
+
+
+/* MessageQueue.codec */
+static PyObject *
+MessageQueue_codec_get(MessageQueue *self, void *closure)
+{
+    if (self->codec) {
+        return PyUnicode_FromString(self->codec->name);
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* MessageQueue.spooled */
+static PyObject *
+MessageQueue_spooled_get(MessageQueue *self, void *closure)
+{
+    if (self->spool) {
+        return PyLong_FromUnsignedLongLong(_mqueue_spool_count(self->spool));
+    }
+    return PyLong_FromLong(0);
+}
+
+
+/* MessageQueue.blocking */
+static PyObject *
+MessageQueue_blocking_get(MessageQueue *self, void *closure)
+{
+    return PyBool_FromLong(__mq_getblocking(self));
+}
+
+static int
+MessageQueue_blocking_set(MessageQueue *self, PyObject *value, void *closure)
+{
+    int blocking = -1;
+
+    _Py_PROTECTED_ATTRIBUTE(value, -1);
+    if ((blocking = PyObject_IsTrue(value)) < 0) {
+        return -1;
+    }
+    return __mq_setblocking(self, blocking);
+}
+
+
+/* MessageQueue_Type.tp_getset */
+static PyGetSetDef MessageQueue_tp_getset[] = {
+    {
+        "name", (getter)MessageQueue_name_get,
+        _Py_READONLY_ATTRIBUTE, NULL, NULL
+    },
+    {
+        "closed", (getter)MessageQueue_closed_get,
+        _Py_READONLY_ATTRIBUTE, NULL, NULL
+    },
+    {
+        "codec", (getter)MessageQueue_codec_get,
+        _Py_READONLY_ATTRIBUTE, NULL, NULL
+    },
+    {
+        "spooled", (getter)MessageQueue_spooled_get,
+        _Py_READONLY_ATTRIBUTE, NULL, NULL
+    },
+    {
+        "blocking", (getter)MessageQueue_blocking_get,
+        (setter)MessageQueue_blocking_set, NULL, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot mqueue_type_slots[] = {
+    {Py_tp_doc, "MessageQueue(name, flags[, mode=0o600, maxmsg=-1, msgsize=-1, codec=None])"},
+    {Py_tp_new, MessageQueue_tp_new},
+    {Py_tp_traverse, MessageQueue_tp_traverse},
+    {Py_tp_finalize, MessageQueue_tp_finalize},
+    {Py_tp_clear, MessageQueue_tp_clear},
+    {Py_tp_dealloc, MessageQueue_tp_dealloc},
+    {Py_tp_repr, MessageQueue_tp_repr},
+    {Py_sq_length, MessageQueue_sq_length},
+    {Py_tp_methods, MessageQueue_tp_methods},
+    {Py_tp_members, MessageQueue_tp_members},
+    {Py_tp_getset, MessageQueue_tp_getset},
+    {0, NULL}
+};
+
+
+static PyType_Spec mqueue_type_spec = {
+    .name = "mood.mqueue.MessageQueue",
+    .basicsize = sizeof(MessageQueue),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_FINALIZE,
+    .slots = mqueue_type_slots
+};
+
+
+/* --------------------------------------------------------------------------
+   RecordQueue
+   -------------------------------------------------------------------------- */
+
+static inline Py_ssize_t
+__rq_itemsize(PyObject *format)
+{
+    PyObject *struct_module = NULL, *result = NULL;
+    Py_ssize_t itemsize = -1;
+
+    // a dtype-like object, or a struct format
+    if (PyObject_HasAttrString(format, "itemsize")) {
+        result = PyObject_GetAttrString(format, "itemsize");
+    }
+    else if ((struct_module = PyImport_ImportModule("struct"))) {
+        result = PyObject_CallMethod(struct_module, "calcsize", "O", format);
+        Py_DECREF(struct_module);
+    }
+    if (result) {
+        itemsize = PyLong_AsSsize_t(result);
+        Py_DECREF(result);
+    }
+    return itemsize;
+}
+
+
+static inline int
+__rq_init(RecordQueue *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {
+        "name", "flags", "format", "mode", "maxmsg", "msgsize", "codec", NULL
+    };
+    MessageQueue *base = (MessageQueue *)self;
+    const char *codec = NULL;
+    Py_ssize_t payload = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "O&iO|Illz:__new__", kwlist,
+            PyUnicode_FSConverter, &base->name,
+            &base->flags, &self->format, &base->mode,
+            &base->attr.mq_maxmsg, &base->attr.mq_msgsize,
+            &codec
+        )
+    ) {
+        return -1;
+    }
+    Py_INCREF(self->format);
+    if ((self->itemsize = __rq_itemsize(self->format)) < 0) {
+        return -1;
+    }
+    if (self->itemsize < 1) {
+        PyErr_SetString(PyExc_ValueError, "record size must be at least 1");
+        return -1;
+    }
+    if (base->attr.mq_msgsize < 0) {
+        base->attr.mq_msgsize = self->itemsize + ((codec) ? 1 : 0);
+    }
+    if (__mq_open(base, codec)) {
+        return -1;
+    }
+    payload = base->attr.mq_msgsize - ((base->codec) ? 1 : 0);
+    if (self->itemsize > payload) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "record size (%zd) exceeds message size (%zd)",
+            self->itemsize,
+            payload
+        );
+        return -1;
+    }
+    return 0;
+}
+
+
+/* once some records went through, running out of them (or of room) right now
+   is not an error, returns 0 or -1 */
+static inline int
+__rq_partial(Py_ssize_t done)
+{
+    if (
+        done &&
+        ((errno == EAGAIN) || (errno == ETIMEDOUT) || (errno == EINTR))
+    ) {
+        return 0;
+    }
+    return -1;
+}
+
+
+/* sends count records, *done is the number of records sent,
+   returns 0 or -1 (errno) */
+static int
+_rq_send_array(RecordQueue *self, const char *buf, Py_ssize_t count,
+               unsigned int priority, Py_ssize_t *done)
+{
+    MessageQueue *base = (MessageQueue *)self;
+
+    for (*done = 0; *done < count; ++*done, buf += self->itemsize) {
+        if (_mq_send_msg(base, buf, self->itemsize, priority, 0, NULL) < 0) {
+            return __rq_partial(*done);
+        }
+    }
+    return 0;
+}
+
+
+/* receives up to count records (only waits for the first one), *done is the
+   number of records received, returns 0 or -1 (errno) */
+static int
+_rq_receive_array(RecordQueue *self, char *buf, Py_ssize_t count,
+                  Py_ssize_t *done)
+{
+    static const struct timespec expired = { 0 };
+    MessageQueue *base = (MessageQueue *)self;
+    const struct timespec *abstime = NULL;
+    mqueue_buffer *buffer = NULL;
+    const char *data = NULL;
+    Py_ssize_t size = -1;
+
+    for (
+        *done = 0;
+        *done < count;
+        ++*done, buf += self->itemsize, abstime = &expired
+    ) {
+        if (
+            !base->codec &&
+            (((count - *done) * self->itemsize) >= base->attr.mq_msgsize)
+        ) {
+            // straight into buf
+            data = buf;
+            size = (abstime) ?
+                mq_timedreceive(base->mqd, buf, base->attr.mq_msgsize,
+                                NULL, abstime) :
+                mq_receive(base->mqd, buf, base->attr.mq_msgsize, NULL);
+        }
+        else {
+            size = _mq_receive(base, &buffer, &data, NULL, abstime);
+        }
+        if (size < 0) {
+            return __rq_partial(*done);
+        }
+        if (data != buf) {
+            if (size == self->itemsize) {
+                memcpy(buf, data, size);
+            }
+            _mq_release(base, buffer);
+        }
+        if (size != self->itemsize) {
+            errno = EBADMSG;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* RecordQueue_Type --------------------------------------------------------- */
+
+/* RecordQueue_Type.tp_new */
+static PyObject *
+RecordQueue_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    RecordQueue *self = NULL;
+
+    if ((self = (RecordQueue *)__mq_new(type))) {
+        self->format = NULL;
+        self->itemsize = 0;
+        if (__rq_init(self, args, kwargs)) {
+            Py_CLEAR(self);
+        }
+    }
+    return (PyObject *)self;
+}
+
+
+/* RecordQueue_Type.tp_traverse */
+static int
+RecordQueue_tp_traverse(RecordQueue *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->format);
+    return MessageQueue_tp_traverse((MessageQueue *)self, visit, arg);
+}
+
+
+/* RecordQueue_Type.tp_clear */
+static int
+RecordQueue_tp_clear(RecordQueue *self)
+{
+    Py_CLEAR(self->format);
+    return MessageQueue_tp_clear((MessageQueue *)self);
+}
+
+
+/* RecordQueue_Type.tp_dealloc */
+static void
+RecordQueue_tp_dealloc(RecordQueue *self)
+{
+    if (PyObject_CallFinalizerFromDealloc((PyObject *)self)) {
+        return;
+    }
+    Py_CLEAR(self->format);
+    MessageQueue_tp_dealloc((MessageQueue *)self);
+}
+
+
+/* RecordQueue.send_array(buf[, priority]) */
+PyDoc_STRVAR(RecordQueue_send_array_doc,
+"send_array(buf[, priority]) -> int\n\
+Sends each record in buf as 1 message. Returns the number of records sent.");
+
+static PyObject *
+RecordQueue_send_array(RecordQueue *self, PyObject *args)
+{
+    PyObject *obj = NULL;
+    Py_buffer buf;
+    unsigned int priority = 0;
+    Py_ssize_t count = 0;
+    int res = -1;
+
+    if (
+        !PyArg_ParseTuple(args, "O|I:send_array", &obj, &priority) ||
+        PyObject_GetBuffer(obj, &buf, PyBUF_C_CONTIGUOUS)
+    ) {
+        return NULL;
+    }
+    if (buf.len % self->itemsize) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "buffer size (%zd) is not a multiple of the record size (%zd)",
+            buf.len,
+            self->itemsize
+        );
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    res = _rq_send_array(self, buf.buf, (buf.len / self->itemsize), priority,
+                         &count);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buf);
+    if (res) {
+        return __mq_partial_error("records", count);
+    }
+    return PyLong_FromSsize_t(count);
+}
+
+
+/* RecordQueue.receive_array(buf[, n]) */
+PyDoc_STRVAR(RecordQueue_receive_array_doc,
+"receive_array(buf[, n]) -> int\n\
+Receives up to n records into buf. Returns the number of records received.");
+
+static PyObject *
+RecordQueue_receive_array(RecordQueue *self, PyObject *args)
+{
+    PyObject *obj = NULL;
+    Py_buffer buf;
+    Py_ssize_t n = -1, count = -1, done = 0;
+    int res = 0;
+
+    if (
+        !PyArg_ParseTuple(args, "O|n:receive_array", &obj, &n) ||
+        PyObject_GetBuffer(obj, &buf, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE)
+    ) {
+        return NULL;
+    }
+    count = buf.len / self->itemsize;
+    if (n >= 0) {
+        count = Py_MIN(count, n);
+    }
+    if (count) {
+        Py_BEGIN_ALLOW_THREADS
+        res = _rq_receive_array(self, buf.buf, count, &done);
+        Py_END_ALLOW_THREADS
+    }
+    PyBuffer_Release(&buf);
+    if (res) {
+        return __mq_partial_error("records", done);
+    }
+    return PyLong_FromSsize_t(done);
+}
+
+
+/* RecordQueue_Type.tp_methods */
+static PyMethodDef RecordQueue_tp_methods[] = {
+    {
+        "send_array", (PyCFunction)RecordQueue_send_array,
+        METH_VARARGS, RecordQueue_send_array_doc
+    },
+    {
+        "receive_array", (PyCFunction)RecordQueue_receive_array,
+        METH_VARARGS, RecordQueue_receive_array_doc
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+/* RecordQueue_Type.tp_members */
+static PyMemberDef RecordQueue_tp_members[] = {
+    {
+        "format", T_OBJECT, offsetof(RecordQueue, format),
+        READONLY, NULL
+    },
+    {
+        "itemsize", T_PYSSIZET, offsetof(RecordQueue, itemsize),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot record_type_slots[] = {
+    {Py_tp_doc, "RecordQueue(name, flags, format[, mode=0o600, maxmsg=-1, msgsize=-1, codec=None])"},
+    {Py_tp_new, RecordQueue_tp_new},
+    {Py_tp_traverse, RecordQueue_tp_traverse},
+    {Py_tp_clear, RecordQueue_tp_clear},
+    {Py_tp_dealloc, RecordQueue_tp_dealloc},
+    {Py_tp_methods, RecordQueue_tp_methods},
+    {Py_tp_members, RecordQueue_tp_members},
+    {0, NULL}
+};
+
+
+static PyType_Spec record_type_spec = {
+    .name = "mood.mqueue.RecordQueue",
+    .basicsize = sizeof(RecordQueue),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_FINALIZE,
+    .slots = record_type_slots
+};
+
+
+static int
+_mqueue_add_record_type(PyObject *module)
+{
+    PyObject *base = NULL, *type = NULL;
+    int res = -1;
+
+    if ((base = PyObject_GetAttrString(module, "MessageQueue"))) {
+        if ((type = PyType_FromModuleAndSpec(module, &record_type_spec, base))) {
+            res = PyModule_AddType(module, (PyTypeObject *)type);
+            Py_DECREF(type);
+        }
+        Py_DECREF(base);
+    }
+    return res;
+}
+
+
+/* --------------------------------------------------------------------------
+   LocalQueue
+   -------------------------------------------------------------------------- */
+
+#define MQUEUE_LOCAL_CAPSULE "mood.mqueue._local"
+
+
+static void
+_mqueue_local_capsule_destructor(PyObject *capsule)
+{
+    _mqueue_local_decref(PyCapsule_GetPointer(capsule, MQUEUE_LOCAL_CAPSULE));
+}
+
+
+static inline LocalQueue *
+__lq_new(PyTypeObject *type)
+{
+    LocalQueue *self = NULL;
+
+    if ((self = PyObject_GC_NEW(LocalQueue, type))) {
+        self->name = NULL;
+        self->flags = 0;
+        self->mode = S_IRUSR | S_IWUSR; // ReadWrite by owner;
+        self->attr.mq_flags = 0;
+        self->attr.mq_maxmsg = -1;
+        self->attr.mq_msgsize = -1;
+        self->attr.mq_curmsgs = 0;
+        self->local = NULL;
+        self->owner = 0;
+        self->msg = NULL;
+        self->callback = NULL;
+        self->signum = 0;
+        self->cfd = -1;
+        PyObject_GC_Track(self);
+    }
+    return self;
+}
+
+
+static inline int
+__lq_init(LocalQueue *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {
+        "name", "flags", "mode", "maxmsg", "msgsize", "codec", NULL
+    };
+    module_state *state = NULL;
+    const char *name = NULL, *codec = NULL;
+    PyObject *entry = NULL, *capsule = NULL;
+
+    if (
+        !(state = __PyObject_GetState__((PyObject *)self)) ||
+        !PyArg_ParseTupleAndKeywords(
+            args, kwargs, "O&i|Illz:__new__", kwlist,
+            PyUnicode_FSConverter, &self->name,
+            &self->flags, &self->mode,
+            &self->attr.mq_maxmsg, &self->attr.mq_msgsize,
+            &codec
+        ) ||
+        // accepted for compatibility, there is nothing to gain in-process
+        (codec && !_mqueue_get_codec(codec)) ||
+        _mqueue_check_attr(state, &self->attr)
+    ) {
+        return -1;
+    }
+
+    name = PyBytes_AS_STRING(self->name);
+    if ((name[0] != '/') || !name[1] || strchr((name + 1), '/')) {
+        errno = EINVAL;
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+    if (
+        !(entry = PyDict_GetItemWithError(state->locals, self->name)) &&
+        PyErr_Occurred()
+    ) {
+        return -1;
+    }
+    if (entry && (entry != Py_None)) {
+        if ((self->flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+            errno = EEXIST;
+            _PyErr_SetFromErrnoWithFilename(name);
+            return -1;
+        }
+        if (!(self->local = PyCapsule_GetPointer(entry, MQUEUE_LOCAL_CAPSULE))) {
+            return -1;
+        }
+        self->local->refcnt++;
+    }
+    else if ((self->flags & O_CREAT)) {
+        if (
+            !(self->local = _mqueue_local_new(self->attr.mq_maxmsg,
+                                              self->attr.mq_msgsize,
+                                              self->mode))
+        ) {
+            return -1;
+        }
+        self->local->refcnt++; // capsule
+        if (
+            !(capsule = PyCapsule_New(self->local, MQUEUE_LOCAL_CAPSULE,
+                                      _mqueue_local_capsule_destructor))
+        ) {
+            self->local->refcnt--;
+            return -1;
+        }
+        if (PyDict_SetItem(state->locals, self->name, capsule)) {
+            Py_DECREF(capsule);
+            return -1;
+        }
+        Py_DECREF(capsule);
+        self->owner = 1;
+    }
+    else {
+        errno = ENOENT;
+        _PyErr_SetFromErrnoWithFilename(name);
+        return -1;
+    }
+
+    self->mode = self->local->mode;
+    self->attr.mq_flags = (self->flags & O_NONBLOCK);
+    self->attr.mq_maxmsg = self->local->maxmsg;
+    self->attr.mq_msgsize = self->local->msgsize;
+
+    if (!(self->msg = PyObject_Malloc(self->attr.mq_msgsize))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if ((self->cfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline int
+__lq_close(LocalQueue *self)
+{
+    module_state *state = NULL;
+    PyObject *entry = NULL;
+    int res = 0;
+
+    if (self->local) {
+        // wake up the threads blocked on this object
+        __local_signal(self->cfd);
+        if (self->local->notify == self) {
+            self->local->notify = NULL;
+        }
+        if (
+            self->owner &&
+            (state = __PyObject_GetState__((PyObject *)self)) &&
+            state->locals
+        ) {
+            // unlink, the name stays registered
+            if (
+                (entry = PyDict_GetItemWithError(state->locals, self->name)) &&
+                (entry != Py_None) &&
+                (PyCapsule_GetPointer(entry, MQUEUE_LOCAL_CAPSULE) == self->local)
+            ) {
+                res = PyDict_SetItem(state->locals, self->name, Py_None);
+            }
+            else if (PyErr_Occurred()) {
+                res = -1;
+            }
+        }
+        _mqueue_local_decref(self->local);
+        self->local = NULL;
+    }
+    return res;
+}
+
+
+static inline int
+__lq_check(LocalQueue *self, int access)
+{
+    int mode = (self->flags & O_ACCMODE);
+
+    if (!self->local || ((mode != O_RDWR) && (mode != access))) {
+        errno = EBADF;
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+    return 0;
+}
+
+
+static inline int
+__lq_getblocking(LocalQueue *self)
+{
+    return ((self->attr.mq_flags & O_NONBLOCK) == 0);
+}
+
+static inline int
+__lq_setblocking(LocalQueue *self, int blocking)
+{
+    self->attr.mq_flags = (blocking) ? 0 : O_NONBLOCK;
+    // should we?
+    if (blocking) {
+        self->flags &= ~O_NONBLOCK;
+    }
+    else {
+        self->flags |= O_NONBLOCK;
+    }
+    return 0;
+}
+
+
+/* -------------------------------------------------------------------------- */
+
+/* one-shot, in the sending thread */
+static void
+__lq_notify(mqueue_local *local)
+{
+    LocalQueue *self = local->notify;
+    PyObject *callback = NULL, *result = NULL;
+
+    if (!self) {
+        return;
+    }
+    local->notify = NULL;
+    if (self->signum) {
+        kill(getpid(), self->signum);
+        self->signum = 0;
+    }
+    else if ((callback = self->callback)) {
+        self->callback = NULL;
+        Py_INCREF(self);
+        if ((result = PyObject_CallOneArg(callback, (PyObject *)self))) {
+            Py_DECREF(result);
+        }
+        else {
+            PyErr_WriteUnraisable(callback);
+        }
+        Py_DECREF(callback);
+        Py_DECREF(self);
+    }
+}
+
+
+static inline int
+__lq_send(LocalQueue *self, mqueue_local_ring *ring, const char *buf,
+          Py_ssize_t size)
+{
+    mqueue_local *local = self->local;
+    int res = -1;
+
+    if (!local) {
+        errno = EBADF;
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+    local->refcnt++; // close() must not free it (and ring) while we wait
+    // only let go of the GIL if we have to wait
+    if (
+        ((res = _mqueue_local_send(local, ring, buf, size, 0, -1)) < 0) &&
+        (errno == EAGAIN) && __lq_getblocking(self)
+    ) {
+        do {
+            Py_BEGIN_ALLOW_THREADS
+            res = _mqueue_local_send(local, ring, buf, size, 1, self->cfd);
+            Py_END_ALLOW_THREADS
+        } while ((res < 0) && (errno == EINTR) && !PyErr_CheckSignals());
+    }
+    if (res < 0) {
+        if (!PyErr_Occurred()) {
+            _PyErr_SetFromErrno();
+        }
+    }
+    else if (res) {
+        __lq_notify(local);
+    }
+    _mqueue_local_decref(local);
+    return (res < 0) ? -1 : 0;
+}
+
+
+/* receives into self->msg with the GIL held, only lets go of it to wait */
+static inline Py_ssize_t
+__lq_receive(LocalQueue *self)
+{
+    mqueue_local *local = NULL;
+    Py_ssize_t size = -1;
+    int res = 0;
+
+    while (!res) {
+        if (!(local = self->local)) {
+            errno = EBADF;
+            break;
+        }
+        if (
+            ((size = _mqueue_local_receive(local, self->msg)) >= 0) ||
+            (errno != EAGAIN) || !__lq_getblocking(self)
+        ) {
+            break;
+        }
+        local->refcnt++; // close() must not free it while we wait
+        Py_BEGIN_ALLOW_THREADS
+        res = __local_wait(local->rfd, self->cfd);
+        Py_END_ALLOW_THREADS
+        _mqueue_local_decref(local);
+        if (res && (errno == EINTR) && !PyErr_CheckSignals()) {
+            res = 0;
+        }
+    }
+    if ((size < 0) && !PyErr_Occurred()) {
+        _PyErr_SetFromErrno();
+    }
+    return size;
+}
+
+
+/* LocalQueue_Type ---------------------------------------------------------- */
+
+/* LocalQueue_Type.tp_new */
+static PyObject *
+LocalQueue_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    LocalQueue *self = NULL;
+
+    if ((self = __lq_new(type)) && __lq_init(self, args, kwargs)) {
+        Py_CLEAR(self);
+    }
+    return (PyObject *)self;
+}
+
+
+/* LocalQueue_Type.tp_traverse */
+static int
+LocalQueue_tp_traverse(LocalQueue *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->callback);
+    Py_VISIT(self->name);
+    Py_VISIT(Py_TYPE(self)); // heap type
+    return 0;
+}
+
+
+/* LocalQueue_Type.tp_finalize */
+static void
+LocalQueue_tp_finalize(LocalQueue *self)
+{
+    PyObject *exc_type, *exc_value, *exc_traceback;
 
     PyErr_Fetch(&exc_type, &exc_value, &exc_traceback);
-    if (__mq_close(self)) {
+    if (__lq_close(self)) {
         PyErr_WriteUnraisable((PyObject *)self);
     }
-    PyErr_Restore(exc_type, exc_value, exc_traceback);
+    PyErr_Restore(exc_type, exc_value, exc_traceback);
+}
+
+
+/* LocalQueue_Type.tp_clear */
+static int
+LocalQueue_tp_clear(LocalQueue *self)
+{
+    Py_CLEAR(self->callback);
+    Py_CLEAR(self->name);
+    return 0;
+}
+
+
+/* LocalQueue_Type.tp_dealloc */
+static void
+LocalQueue_tp_dealloc(LocalQueue *self)
+{
+    if (PyObject_CallFinalizerFromDealloc((PyObject *)self)) {
+        return;
+    }
+    PyObject_GC_UnTrack(self);
+    if (self->msg) {
+        PyObject_Free(self->msg);
+        self->msg = NULL;
+    }
+    if (self->cfd != -1) {
+        close(self->cfd);
+        self->cfd = -1;
+    }
+    LocalQueue_tp_clear(self);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
+}
+
+
+/* LocalQueue_Type.tp_repr */
+static PyObject *
+LocalQueue_tp_repr(LocalQueue *self)
+{
+    PyObject *result = NULL, *name = NULL;
+
+    if ((name = PyUnicode_DecodeFSDefault(PyBytes_AS_STRING(self->name)))) {
+        result = PyUnicode_FromFormat(
+            "<%s('%U', %d, mode=%u, maxmsg=%ld, msgsize=%ld)>",
+            Py_TYPE(self)->tp_name, name, self->flags, self->mode,
+            self->attr.mq_maxmsg, self->attr.mq_msgsize
+        );
+        Py_DECREF(name);
+    }
+    return result;
+}
+
+
+/* len() */
+static Py_ssize_t
+LocalQueue_sq_length(LocalQueue *self)
+{
+    if (!self->local) {
+        errno = EBADF;
+        _PyErr_SetFromErrno();
+        return -1;
+    }
+    return (self->attr.mq_curmsgs = _mqueue_local_count(self->local));
+}
+
+
+/* LocalQueue.close() */
+static PyObject *
+LocalQueue_close(LocalQueue *self)
+{
+    return (__lq_close(self)) ? NULL : Py_NewRef(Py_None);
+}
+
+
+/* LocalQueue.fileno() */
+PyDoc_STRVAR(LocalQueue_fileno_doc,
+"fileno() -> int\n\
+Returns an eventfd that is readable while there are messages in the queue.");
+
+static PyObject *
+LocalQueue_fileno(LocalQueue *self)
+{
+    return PyLong_FromLong((self->local) ? self->local->rfd : -1);
+}
+
+
+/* LocalQueue.send(msg[, priority]) */
+static PyObject *
+LocalQueue_send(LocalQueue *self, PyObject *args)
+{
+    Py_buffer msg;
+    unsigned int priority = 0;
+    mqueue_local_ring *ring = NULL;
+    Py_ssize_t size = 0;
+
+    if (!PyArg_ParseTuple(args, "y*|I:send", &msg, &priority)) {
+        return NULL;
+    }
+    size = Py_MIN(msg.len, self->attr.mq_msgsize);
+    if (
+        __lq_check(self, O_WRONLY) ||
+        !(ring = _mqueue_local_ring(self->local, priority)) ||
+        __lq_send(self, ring, msg.buf, size)
+    ) {
+        PyBuffer_Release(&msg);
+        return NULL;
+    }
+    PyBuffer_Release(&msg);
+    return PyLong_FromSsize_t(size);
+}
+
+
+/* LocalQueue.sendall(msg[, priority]) */
+static PyObject *
+LocalQueue_sendall(LocalQueue *self, PyObject *args)
+{
+    Py_buffer msg;
+    unsigned int priority = 0;
+    mqueue_local_ring *ring = NULL;
+    Py_ssize_t size = 0;
+    const char *buf = NULL;
+    Py_ssize_t len = 0;
+
+    if (!PyArg_ParseTuple(args, "y*|I:sendall", &msg, &priority)) {
+        return NULL;
+    }
+    if (
+        __lq_check(self, O_WRONLY) ||
+        !(ring = _mqueue_local_ring(self->local, priority))
+    ) {
+        PyBuffer_Release(&msg);
+        return NULL;
+    }
+    buf = msg.buf;
+    len = msg.len;
+    do {
+        size = Py_MIN(len, self->attr.mq_msgsize);
+        if (__lq_send(self, ring, buf, size)) {
+            PyBuffer_Release(&msg);
+            return NULL;
+        }
+        buf += size;
+        len -= size;
+    } while (len > 0);
+    PyBuffer_Release(&msg);
+    Py_RETURN_NONE;
+}
+
+
+/* LocalQueue.receive() */
+static PyObject *
+LocalQueue_receive(LocalQueue *self)
+{
+    Py_ssize_t size = -1;
+
+    if (__lq_check(self, O_RDONLY) || (size = __lq_receive(self)) < 0) {
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize(self->msg, size);
+}
+
+
+/* LocalQueue.notify([callback]) */
+PyDoc_STRVAR(LocalQueue_notify_doc,
+"notify([callback])\n\
+Register or unregister for notification (delivered in the sending thread).");
+
+static PyObject *
+LocalQueue_notify(LocalQueue *self, PyObject *args)
+{
+    PyObject *callback = NULL;
+    int signum = 0;
+
+    if (
+        !PyArg_ParseTuple(args, "|O:notify", &callback) ||
+        __lq_check(self, O_RDONLY)
+    ) {
+        return NULL;
+    }
+    if (callback) {
+        if (PyLong_Check(callback)) {
+            signum = _PyLong_AsInt(callback);
+            if (signum == -1 && PyErr_Occurred()) {
+                return NULL;
+            }
+            if (signum < 1 || signum >= NSIG) {
+                PyErr_SetString(PyExc_ValueError, "signal number out of range");
+                return NULL;
+            }
+        }
+        else if (callback != Py_None && !PyCallable_Check(callback)) {
+            PyErr_SetString(
+                PyExc_TypeError,
+                "a callable, a signal number or None is required"
+            );
+            return NULL;
+        }
+        if (self->local->notify && (self->local->notify != self)) {
+            errno = EBUSY;
+            return _PyErr_SetFromErrno();
+        }
+        self->local->notify = self;
+    }
+    else if (self->local->notify == self) {
+        self->local->notify = NULL;
+    }
+    self->signum = signum;
+    if (callback && !signum && (callback != Py_None)) {
+        _Py_SET_MEMBER(self->callback, callback);
+    }
+    else {
+        Py_CLEAR(self->callback);
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* LocalQueue.fill(buf[, priority]) */
+static PyObject *
+LocalQueue_fill(LocalQueue *self, PyObject *args)
+{
+    PyByteArrayObject *buf = NULL;
+    unsigned int priority = 0;
+    mqueue_local_ring *ring = NULL;
+    Py_ssize_t len, size = 0;
+
+    if (!PyArg_ParseTuple(args, "Y|I:fill", &buf, &priority) ||
+        __buf_exported(buf) ||
+        __lq_check(self, O_WRONLY) ||
+        !(ring = _mqueue_local_ring(self->local, priority))) {
+        return NULL;
+    }
+    while ((len = Py_SIZE(buf)) > 0) {
+        size = Py_MIN(len, self->attr.mq_msgsize);
+        if (__lq_send(self, ring, buf->ob_start, size)) {
+            return NULL;
+        }
+        // XXX: very bad shortcut ¯\_(ツ)_/¯
+        buf->ob_start += size;
+        __buf_shrink(buf, (len - size));
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* LocalQueue.drain(buf) */
+static PyObject *
+LocalQueue_drain(LocalQueue *self, PyObject *args)
+{
+    PyByteArrayObject *buf = NULL;
+    long i, len = 0;
+    Py_ssize_t size = -1;
+
+    if (!PyArg_ParseTuple(args, "Y:drain", &buf) ||
+        __buf_exported(buf) ||
+        __lq_check(self, O_RDONLY)) {
+        return NULL;
+    }
+    len = _mqueue_local_count(self->local);
+    len = len ? len : 1;
+    for (i = 0; i < len; ++i) {
+        if ((size = __lq_receive(self)) < 0) {
+            return NULL;
+        }
+        if (!size) {
+            break;
+        }
+        if ((i == 0 && __buf_resize(buf, (len * self->attr.mq_msgsize))) ||
+            __buf_grow(buf, self->msg, size)) {
+            return NULL;
+        }
+    }
+    return PyBool_FromLong((size == 0));
+}
+
+
+/* LocalQueue_Type.tp_methods */
+static PyMethodDef LocalQueue_tp_methods[] = {
+    {
+        "close", (PyCFunction)LocalQueue_close,
+        METH_NOARGS, MessageQueue_close_doc
+    },
+    {
+        "fileno", (PyCFunction)LocalQueue_fileno,
+        METH_NOARGS, LocalQueue_fileno_doc
+    },
+    {
+        "send", (PyCFunction)LocalQueue_send,
+        METH_VARARGS, MessageQueue_send_doc
+    },
+    {
+        "sendall", (PyCFunction)LocalQueue_sendall,
+        METH_VARARGS, MessageQueue_sendall_doc
+    },
+    {
+        "receive", (PyCFunction)LocalQueue_receive,
+        METH_NOARGS, MessageQueue_receive_doc
+    },
+    {
+        "notify", (PyCFunction)LocalQueue_notify,
+        METH_VARARGS, LocalQueue_notify_doc
+    },
+    {
+        "fill", (PyCFunction)LocalQueue_fill,
+        METH_VARARGS, MessageQueue_fill_doc
+    },
+    {
+        "drain", (PyCFunction)LocalQueue_drain,
+        METH_VARARGS, MessageQueue_drain_doc
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+/* LocalQueue_Type.tp_members */
+static PyMemberDef LocalQueue_tp_members[] = {
+    {
+        "flags", T_INT, offsetof(LocalQueue, flags),
+        READONLY, NULL
+    },
+    {
+        "mode", T_UINT, offsetof(LocalQueue, mode),
+        READONLY, NULL
+    },
+    {
+        "maxmsg", T_LONG, offsetof(LocalQueue, attr.mq_maxmsg),
+        READONLY, NULL
+    },
+    {
+        "msgsize", T_LONG, offsetof(LocalQueue, attr.mq_msgsize),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+/* LocalQueue.name */
+static PyObject *
+LocalQueue_name_get(LocalQueue *self, void *closure)
+{
+    return PyUnicode_DecodeFSDefault(PyBytes_AS_STRING(self->name));
+}
+
+
+/* LocalQueue.closed */
+static PyObject *
+LocalQueue_closed_get(LocalQueue *self, void *closure)
+{
+    return PyBool_FromLong((self->local == NULL));
+}
+
+
+/* LocalQueue.codec */
+static PyObject *
+LocalQueue_codec_get(LocalQueue *self, void *closure)
+{
+    Py_RETURN_NONE;
+}
+
+
+/* LocalQueue.blocking */
+static PyObject *
+LocalQueue_blocking_get(LocalQueue *self, void *closure)
+{
+    return PyBool_FromLong(__lq_getblocking(self));
+}
+
+static int
+LocalQueue_blocking_set(LocalQueue *self, PyObject *value, void *closure)
+{
+    int blocking = -1;
+
+    _Py_PROTECTED_ATTRIBUTE(value, -1);
+    if ((blocking = PyObject_IsTrue(value)) < 0) {
+        return -1;
+    }
+    return __lq_setblocking(self, blocking);
+}
+
+
+/* LocalQueue_Type.tp_getset */
+static PyGetSetDef LocalQueue_tp_getset[] = {
+    {
+        "name", (getter)LocalQueue_name_get,
+        _Py_READONLY_ATTRIBUTE, NULL, NULL
+    },
+    {
+        "closed", (getter)LocalQueue_closed_get,
+        _Py_READONLY_ATTRIBUTE, NULL, NULL
+    },
+    {
+        "codec", (getter)LocalQueue_codec_get,
+        _Py_READONLY_ATTRIBUTE, NULL, NULL
+    },
+    {
+        "blocking", (getter)LocalQueue_blocking_get,
+        (setter)LocalQueue_blocking_set, NULL, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot local_type_slots[] = {
+    {Py_tp_doc, "LocalQueue(name, flags[, mode=0o600, maxmsg=-1, msgsize=-1, codec=None])"},
+    {Py_tp_new, LocalQueue_tp_new},
+    {Py_tp_traverse, LocalQueue_tp_traverse},
+    {Py_tp_finalize, LocalQueue_tp_finalize},
+    {Py_tp_clear, LocalQueue_tp_clear},
+    {Py_tp_dealloc, LocalQueue_tp_dealloc},
+    {Py_tp_repr, LocalQueue_tp_repr},
+    {Py_sq_length, LocalQueue_sq_length},
+    {Py_tp_methods, LocalQueue_tp_methods},
+    {Py_tp_members, LocalQueue_tp_members},
+    {Py_tp_getset, LocalQueue_tp_getset},
+    {0, NULL}
+};
+
+
+static PyType_Spec local_type_spec = {
+    .name = "mood.mqueue.LocalQueue",
+    .basicsize = sizeof(LocalQueue),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_FINALIZE,
+    .slots = local_type_slots
+};
+
+
+/* --------------------------------------------------------------------------
+   RPC
+   -------------------------------------------------------------------------- */
+
+static PyObject *
+_mqueue_rpc_check_queue(PyTypeObject *type, PyObject *queue)
+{
+    PyObject *module = NULL, *mqueue_type = NULL;
+    int res = -1;
+
+    if (
+        (module = PyType_GetModule(type)) &&
+        (mqueue_type = PyObject_GetAttrString(module, "MessageQueue"))
+    ) {
+        if (!(res = PyObject_IsInstance(queue, mqueue_type))) {
+            PyErr_Format(PyExc_TypeError,
+                         "expected a MessageQueue, got: %.200s",
+                         Py_TYPE(queue)->tp_name);
+        }
+        if (res <= 0) {
+            Py_CLEAR(mqueue_type);
+        }
+    }
+    return mqueue_type;
+}
+
+
+/* timeout (in seconds) -> CLOCK_REALTIME deadline, *abstime is set to NULL if
+   timeout is None */
+static int
+_mqueue_rpc_deadline(PyObject *timeout, struct timespec *ts,
+                     struct timespec **abstime)
+{
+    double seconds = 0.0;
+
+    *abstime = NULL;
+    if (timeout == Py_None) {
+        return 0;
+    }
+    if (((seconds = PyFloat_AsDouble(timeout)) == -1.0) && PyErr_Occurred()) {
+        return -1;
+    }
+    if (seconds < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+        return -1;
+    }
+    __spool_deadline(ts, (long)(Py_MIN(seconds, 1e9) * 1e9));
+    *abstime = ts;
+    return 0;
+}
+
+
+/* RpcClient ---------------------------------------------------------------- */
+
+/* lock must be held */
+static inline mqueue_rpc_call **
+__rpc_lookup(RpcClient *self, uint64_t id)
+{
+    mqueue_rpc_call **link = &self->calls;
+
+    while (*link && ((*link)->id != id)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+
+static inline void
+__rpc_call_free(mqueue_rpc_call *call)
+{
+    PyMem_RawFree(call->data);
+    PyMem_RawFree(call);
+}
+
+
+/* leader only, receives 1 reply and hands it over to its call,
+   returns 0 or an errno */
+static int
+__rpc_dispatch(RpcClient *self, const struct timespec *abstime)
+{
+    mqueue_rpc_call *call = NULL;
+    mqueue_buffer *buffer = NULL;
+    const char *data = NULL;
+    Py_ssize_t size = -1;
+    uint64_t id = 0;
+    int32_t status = 0;
+    char *reply = NULL;
+
+    if ((size = _mq_receive(self->replies, &buffer, &data, NULL,
+                            abstime)) < 0) {
+        return errno;
+    }
+    if ((size_t)size < MQUEUE_RPC_REPLY_HEADER) {
+        _mq_release(self->replies, buffer);
+        return 0; // not a reply, drop it
+    }
+    memcpy(&id, data, sizeof(id));
+    memcpy(&status, (data + sizeof(id)), sizeof(status));
+    size -= MQUEUE_RPC_REPLY_HEADER;
+    if (!(reply = PyMem_RawMalloc(Py_MAX(size, 1)))) {
+        _mq_release(self->replies, buffer);
+        return ENOMEM;
+    }
+    memcpy(reply, (data + MQUEUE_RPC_REPLY_HEADER), size);
+    _mq_release(self->replies, buffer);
+    pthread_mutex_lock(&self->lock);
+    if ((call = *__rpc_lookup(self, id)) && !call->ready) {
+        call->data = reply;
+        call->size = size;
+        call->status = status;
+        call->ready = 1;
+        reply = NULL;
+    }
+    pthread_mutex_unlock(&self->lock);
+    // late (cancelled) or unknown call
+    PyMem_RawFree(reply);
+    return 0;
+}
+
+
+/* waits for the reply to call, the first waiting thread receives the replies
+   for everybody, returns 0 or an errno */
+static int
+_mqueue_rpc_wait(RpcClient *self, mqueue_rpc_call *call,
+                 const struct timespec *abstime)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&self->lock);
+    while (!call->ready && !res) {
+        if (self->leader) {
+            if (abstime) {
+                res = pthread_cond_timedwait(&self->cond, &self->lock, abstime);
+            }
+            else {
+                res = pthread_cond_wait(&self->cond, &self->lock);
+            }
+        }
+        else {
+            self->leader = 1;
+            pthread_mutex_unlock(&self->lock);
+            res = __rpc_dispatch(self, abstime);
+            pthread_mutex_lock(&self->lock);
+            self->leader = 0;
+            pthread_cond_broadcast(&self->cond);
+        }
+    }
+    res = (call->ready) ? 0 : res;
+    pthread_mutex_unlock(&self->lock);
+    return res;
+}
+
+
+/* sends a request, returns its id, or 0 on error */
+static uint64_t
+__rpc_submit(RpcClient *self, const char *buf, Py_ssize_t len,
+             unsigned int priority)
+{
+    mqueue_rpc_call *call = NULL, **link = NULL;
+    Py_ssize_t size = -1;
+    uint64_t id = 0;
+
+    if (len > self->maxsize) {
+        PyErr_Format(PyExc_ValueError,
+                     "request too long (maximum is %zd bytes)", self->maxsize);
+        return 0;
+    }
+    if (!(call = PyMem_RawCalloc(1, sizeof(mqueue_rpc_call)))) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    pthread_mutex_lock(&self->lock);
+    call->id = id = ++self->id;
+    call->next = self->calls;
+    self->calls = call;
+    pthread_mutex_unlock(&self->lock);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->send_lock);
+    memcpy(self->msg, &id, sizeof(id));
+    memcpy((self->msg + self->hdrsize), buf, len);
+    size = _mq_send_msg(self->requests, self->msg, (self->hdrsize + len),
+                        priority, 0, NULL);
+    pthread_mutex_unlock(&self->send_lock);
+    Py_END_ALLOW_THREADS
+    if (size < 0) {
+        _PyErr_SetFromErrno();
+        pthread_mutex_lock(&self->lock);
+        if (*(link = __rpc_lookup(self, id)) == call) {
+            *link = call->next;
+        }
+        pthread_mutex_unlock(&self->lock);
+        __rpc_call_free(call);
+        return 0;
+    }
+    return id;
+}
+
+
+/* waits for the reply to request id, and forgets about it (unless the wait
+   timed out) */
+static PyObject *
+__rpc_wait(RpcClient *self, uint64_t id, PyObject *timeout)
+{
+    mqueue_rpc_call *call = NULL;
+    struct timespec ts = { 0 }, *abstime = NULL;
+    PyObject *result = NULL;
+    int res = 0;
+
+    if (_mqueue_rpc_deadline(timeout, &ts, &abstime)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&self->lock);
+    if ((call = *__rpc_lookup(self, id)) && !call->waited) {
+        call->waited = 1;
+    }
+    else {
+        res = (call) ? EBUSY : ENOENT;
+    }
+    pthread_mutex_unlock(&self->lock);
+    if (res) {
+        PyErr_Format((res == ENOENT) ? PyExc_KeyError : PyExc_ValueError,
+                     (res == ENOENT) ? "unknown request: %llu" :
+                     "already waiting for request: %llu",
+                     (unsigned long long)id);
+        return NULL;
+    }
+    do {
+        Py_BEGIN_ALLOW_THREADS
+        res = _mqueue_rpc_wait(self, call, abstime);
+        Py_END_ALLOW_THREADS
+    } while ((res == EINTR) && !PyErr_CheckSignals());
+    pthread_mutex_lock(&self->lock);
+    if (call->ready) {
+        *__rpc_lookup(self, id) = call->next;
+    }
+    else {
+        call->waited = 0;
+    }
+    pthread_mutex_unlock(&self->lock);
+    if (call->ready) {
+        if (call->status) {
+            errno = call->status;
+            _PyErr_SetFromErrno();
+        }
+        else {
+            result = PyBytes_FromStringAndSize(call->data, call->size);
+        }
+        __rpc_call_free(call);
+    }
+    else if (!PyErr_Occurred()) {
+        errno = res;
+        _PyErr_SetFromErrno();
+    }
+    return result;
+}
+
+
+/* forgets about request id, returns 0 if there was no such request */
+static int
+__rpc_cancel(RpcClient *self, uint64_t id)
+{
+    mqueue_rpc_call *call = NULL, **link = NULL;
+    int res = 0;
+
+    pthread_mutex_lock(&self->lock);
+    if ((call = *(link = __rpc_lookup(self, id)))) {
+        if (call->waited) {
+            res = -1;
+        }
+        else {
+            *link = call->next;
+            res = 1;
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+    if (res < 0) {
+        PyErr_Format(PyExc_ValueError, "already waiting for request: %llu",
+                     (unsigned long long)id);
+    }
+    else if (res) {
+        __rpc_call_free(call);
+    }
+    return res;
 }
 
 
-/* MessageQueue_Type.tp_clear */
+static inline RpcClient *
+__rpc_client_new(PyTypeObject *type)
+{
+    RpcClient *self = NULL;
+
+    if ((self = PyObject_GC_NEW(RpcClient, type))) {
+        self->requests = NULL;
+        self->replies = NULL;
+        pthread_mutex_init(&self->lock, NULL);
+        pthread_cond_init(&self->cond, NULL);
+        pthread_mutex_init(&self->send_lock, NULL);
+        self->leader = 0;
+        self->id = 0;
+        self->calls = NULL;
+        self->msg = NULL;
+        self->hdrsize = 0;
+        self->maxsize = 0;
+        PyObject_GC_Track(self);
+    }
+    return self;
+}
+
+
+/* reply queues outlive their clients, ids must not start over from 1 (a late
+   reply to a previous client would be taken for the reply to a new call) */
+static inline uint64_t
+__rpc_seed(void)
+{
+    struct timespec ts = { 0 };
+    uint64_t seed = 0;
+
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = (((uint64_t)getpid() << 32) ^ ((uint64_t)ts.tv_sec << 20) ^
+                (uint64_t)ts.tv_nsec);
+    }
+    return seed;
+}
+
+
+/* drops what is left in the replies queue (replies to a previous client) */
+static inline void
+__rpc_drain(MessageQueue *replies)
+{
+    static const struct timespec expired = { 0 };
+    mqueue_buffer *buffer = NULL;
+    const char *data = NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    while (_mq_receive(replies, &buffer, &data, NULL, &expired) >= 0) {
+        _mq_release(replies, buffer);
+    }
+    Py_END_ALLOW_THREADS
+}
+
+
+static inline int
+__rpc_client_init(RpcClient *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"requests", "replies", NULL};
+    PyObject *requests = NULL, *replies = NULL, *type = NULL;
+    Py_ssize_t namelen = 0, msgsize = 0;
+    uint16_t size = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(args, kwargs, "OO:__new__", kwlist,
+                                     &requests, &replies) ||
+        !(type = _mqueue_rpc_check_queue(Py_TYPE(self), requests))
+    ) {
+        return -1;
+    }
+    Py_DECREF(type);
+    if (!(type = _mqueue_rpc_check_queue(Py_TYPE(self), replies))) {
+        return -1;
+    }
+    Py_DECREF(type);
+    self->requests = (MessageQueue *)Py_NewRef(requests);
+    self->replies = (MessageQueue *)Py_NewRef(replies);
+    namelen = PyBytes_GET_SIZE(self->replies->name);
+    msgsize = self->requests->attr.mq_msgsize - ((self->requests->codec) ? 1 : 0);
+    self->hdrsize = MQUEUE_RPC_REQUEST_HEADER + namelen;
+    if (
+        (namelen > UINT16_MAX) ||
+        ((self->maxsize = (msgsize - self->hdrsize)) < 0)
+    ) {
+        PyErr_SetString(PyExc_ValueError,
+                        "requests msgsize is too small for the request header");
+        return -1;
+    }
+    if (!(self->msg = PyMem_RawMalloc(msgsize))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    size = (uint16_t)namelen;
+    memcpy((self->msg + sizeof(uint64_t)), &size, sizeof(size));
+    memcpy((self->msg + MQUEUE_RPC_REQUEST_HEADER),
+           PyBytes_AS_STRING(self->replies->name), namelen);
+    self->id = __rpc_seed();
+    __rpc_drain(self->replies);
+    return 0;
+}
+
+
+/* RpcClient_Type ----------------------------------------------------------- */
+
+/* RpcClient_Type.tp_new */
+static PyObject *
+RpcClient_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    RpcClient *self = NULL;
+
+    if ((self = __rpc_client_new(type)) && __rpc_client_init(self, args, kwargs)) {
+        Py_CLEAR(self);
+    }
+    return (PyObject *)self;
+}
+
+
+/* RpcClient_Type.tp_traverse */
 static int
-MessageQueue_tp_clear(MessageQueue *self)
+RpcClient_tp_traverse(RpcClient *self, visitproc visit, void *arg)
 {
-    Py_CLEAR(self->callback);
-    Py_CLEAR(self->name);
+    Py_VISIT(self->replies);
+    Py_VISIT(self->requests);
+    Py_VISIT(Py_TYPE(self)); // heap type
     return 0;
 }
 
 
-/* MessageQueue_Type.tp_dealloc */
+/* RpcClient_Type.tp_clear */
+static int
+RpcClient_tp_clear(RpcClient *self)
+{
+    Py_CLEAR(self->replies);
+    Py_CLEAR(self->requests);
+    return 0;
+}
+
+
+/* RpcClient_Type.tp_dealloc */
 static void
-MessageQueue_tp_dealloc(MessageQueue *self)
+RpcClient_tp_dealloc(RpcClient *self)
 {
-    if (PyObject_CallFinalizerFromDealloc((PyObject *)self)) {
-        return;
-    }
+    mqueue_rpc_call *call = NULL;
+
     PyObject_GC_UnTrack(self);
+    while ((call = self->calls)) {
+        self->calls = call->next;
+        __rpc_call_free(call);
+    }
     if (self->msg) {
-        PyObject_Free(self->msg);
+        PyMem_RawFree(self->msg);
         self->msg = NULL;
     }
-    MessageQueue_tp_clear(self);
+    pthread_mutex_destroy(&self->send_lock);
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    RpcClient_tp_clear(self);
     PyTypeObject *type = Py_TYPE(self);
     PyObject_GC_Del(self);
     Py_XDECREF(type); // heap type
 }
 
 
-/* MessageQueue_Type.tp_repr */
+/* RpcClient_Type.sq_length */
+static Py_ssize_t
+RpcClient_sq_length(RpcClient *self)
+{
+    mqueue_rpc_call *call = NULL;
+    Py_ssize_t len = 0;
+
+    pthread_mutex_lock(&self->lock);
+    for (call = self->calls; call; call = call->next) {
+        ++len;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return len;
+}
+
+
+/* RpcClient.submit(payload[, priority]) */
+PyDoc_STRVAR(RpcClient_submit_doc,
+"submit(payload[, priority]) -> int\n\
+Sends a request, returns its id.");
+
 static PyObject *
-MessageQueue_tp_repr(MessageQueue *self)
+RpcClient_submit(RpcClient *self, PyObject *args)
 {
-    PyObject *result = NULL, *name = NULL;
+    Py_buffer payload = { 0 };
+    unsigned int priority = 0;
+    uint64_t id = 0;
 
-    if ((name = PyUnicode_DecodeFSDefault(PyBytes_AS_STRING(self->name)))) {
-        result = PyUnicode_FromFormat(
-            "<%s('%U', %d, mode=%u, maxmsg=%ld, msgsize=%ld)>",
-            Py_TYPE(self)->tp_name, name, self->flags, self->mode,
-            self->attr.mq_maxmsg, self->attr.mq_msgsize
-        );
-        Py_DECREF(name);
+    if (!PyArg_ParseTuple(args, "y*|I:submit", &payload, &priority)) {
+        return NULL;
+    }
+    id = __rpc_submit(self, payload.buf, payload.len, priority);
+    PyBuffer_Release(&payload);
+    return (id) ? PyLong_FromUnsignedLongLong(id) : NULL;
+}
+
+
+/* RpcClient.wait(id[, timeout]) */
+PyDoc_STRVAR(RpcClient_wait_doc,
+"wait(id[, timeout=None]) -> bytes\n\
+Waits for the reply to request id and returns it.");
+
+static PyObject *
+RpcClient_wait(RpcClient *self, PyObject *args)
+{
+    unsigned long long id = 0;
+    PyObject *timeout = Py_None;
+
+    if (!PyArg_ParseTuple(args, "K|O:wait", &id, &timeout)) {
+        return NULL;
+    }
+    return __rpc_wait(self, id, timeout);
+}
+
+
+/* RpcClient.cancel(id) */
+PyDoc_STRVAR(RpcClient_cancel_doc,
+"cancel(id) -> bool\n\
+Forgets about request id (its reply will be dropped).\n\
+Returns whether there was such a request.");
+
+static PyObject *
+RpcClient_cancel(RpcClient *self, PyObject *args)
+{
+    unsigned long long id = 0;
+    int res = -1;
+
+    if (
+        !PyArg_ParseTuple(args, "K:cancel", &id) ||
+        ((res = __rpc_cancel(self, id)) < 0)
+    ) {
+        return NULL;
+    }
+    return PyBool_FromLong(res);
+}
+
+
+/* RpcClient.call(payload[, timeout, priority]) */
+PyDoc_STRVAR(RpcClient_call_doc,
+"call(payload[, timeout=None, priority=0]) -> bytes\n\
+Sends a request and waits for its reply.");
+
+static PyObject *
+RpcClient_call(RpcClient *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"payload", "timeout", "priority", NULL};
+    Py_buffer payload = { 0 };
+    PyObject *timeout = Py_None, *result = NULL;
+    unsigned int priority = 0;
+    uint64_t id = 0;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(args, kwargs, "y*|OI:call", kwlist,
+                                     &payload, &timeout, &priority)
+    ) {
+        return NULL;
+    }
+    id = __rpc_submit(self, payload.buf, payload.len, priority);
+    PyBuffer_Release(&payload);
+    if (id && !(result = __rpc_wait(self, id, timeout))) {
+        __rpc_cancel(self, id);
     }
     return result;
 }
 
 
-/* len() */
-static Py_ssize_t
-MessageQueue_sq_length(MessageQueue *self)
+/* RpcClient_Type.tp_methods */
+static PyMethodDef RpcClient_tp_methods[] = {
+    {
+        "submit", (PyCFunction)RpcClient_submit,
+        METH_VARARGS, RpcClient_submit_doc
+    },
+    {
+        "wait", (PyCFunction)RpcClient_wait,
+        METH_VARARGS, RpcClient_wait_doc
+    },
+    {
+        "cancel", (PyCFunction)RpcClient_cancel,
+        METH_VARARGS, RpcClient_cancel_doc
+    },
+    {
+        "call", (PyCFunction)RpcClient_call,
+        METH_VARARGS | METH_KEYWORDS, RpcClient_call_doc
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+/* RpcClient_Type.tp_members */
+static PyMemberDef RpcClient_tp_members[] = {
+    {
+        "requests", T_OBJECT, offsetof(RpcClient, requests),
+        READONLY, NULL
+    },
+    {
+        "replies", T_OBJECT, offsetof(RpcClient, replies),
+        READONLY, NULL
+    },
+    {
+        "maxsize", T_PYSSIZET, offsetof(RpcClient, maxsize),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot rpc_client_type_slots[] = {
+    {Py_tp_doc, "RpcClient(requests, replies)"},
+    {Py_tp_new, RpcClient_tp_new},
+    {Py_tp_traverse, RpcClient_tp_traverse},
+    {Py_tp_clear, RpcClient_tp_clear},
+    {Py_tp_dealloc, RpcClient_tp_dealloc},
+    {Py_sq_length, RpcClient_sq_length},
+    {Py_tp_methods, RpcClient_tp_methods},
+    {Py_tp_members, RpcClient_tp_members},
+    {0, NULL}
+};
+
+
+static PyType_Spec rpc_client_type_spec = {
+    .name = "mood.mqueue.RpcClient",
+    .basicsize = sizeof(RpcClient),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = rpc_client_type_slots
+};
+
+
+/* RpcServer ---------------------------------------------------------------- */
+
+/* request -> ((reply queue name, id), payload), returns NULL without an
+   exception set if the message is not a request */
+static PyObject *
+__rpc_request(const char *data, Py_ssize_t size)
 {
-    if (mq_getattr(self->mqd, &self->attr)) {
-        _PyErr_SetFromErrno();
+    uint64_t id = 0;
+    uint16_t namelen = 0;
+
+    if ((size_t)size < MQUEUE_RPC_REQUEST_HEADER) {
+        return NULL;
+    }
+    memcpy(&id, data, sizeof(id));
+    memcpy(&namelen, (data + sizeof(id)), sizeof(namelen));
+    data += MQUEUE_RPC_REQUEST_HEADER;
+    size -= MQUEUE_RPC_REQUEST_HEADER;
+    if (!namelen || (namelen > size)) {
+        return NULL;
+    }
+    return Py_BuildValue("((y#K)y#)", data, (Py_ssize_t)namelen,
+                         (unsigned long long)id,
+                         (data + namelen), (size - namelen));
+}
+
+
+/* receives up to count requests (only waits for the first one) */
+static PyObject *
+__rpc_receive(RpcServer *self, Py_ssize_t count,
+              const struct timespec *abstime)
+{
+    static const struct timespec expired = { 0 };
+    PyObject *result = NULL, *item = NULL;
+    mqueue_buffer *buffer = NULL;
+    const char *data = NULL;
+    Py_ssize_t i = 0, size = -1;
+
+    if (!(result = PyList_New(0))) {
+        return NULL;
+    }
+    while (result && ((i = PyList_GET_SIZE(result)) < count)) {
+        Py_BEGIN_ALLOW_THREADS
+        size = _mq_receive(self->requests, &buffer, &data, NULL,
+                           (i) ? &expired : abstime);
+        Py_END_ALLOW_THREADS
+        if (size < 0) {
+            if (i && (errno == EAGAIN || errno == ETIMEDOUT)) {
+                break;
+            }
+            if (errno != EINTR) {
+                _PyErr_SetFromErrno();
+                Py_CLEAR(result);
+            }
+            else if (PyErr_CheckSignals()) {
+                Py_CLEAR(result);
+            }
+        }
+        else {
+            item = __rpc_request(data, size);
+            _mq_release(self->requests, buffer);
+            if (item) {
+                if (PyList_Append(result, item)) {
+                    Py_CLEAR(result);
+                }
+                Py_DECREF(item);
+            }
+            else if (PyErr_Occurred()) {
+                Py_CLEAR(result);
+            }
+        }
+    }
+    return result;
+}
+
+
+/* returns the (cached) reply queue name */
+static MessageQueue *
+__rpc_reply_queue(RpcServer *self, PyObject *name)
+{
+    PyObject *queue = NULL, *args = NULL, *kwargs = NULL;
+
+    if ((queue = PyDict_GetItemWithError(self->replies, name))) {
+        return (MessageQueue *)Py_NewRef(queue);
+    }
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    // never block the server on a client that went away
+    if (
+        (args = Py_BuildValue("(Oi)", name,
+                              (O_WRONLY | O_NONBLOCK | O_CLOEXEC))) &&
+        (kwargs = Py_BuildValue("{sz}", "codec",
+                                (self->requests->codec) ?
+                                self->requests->codec->name : NULL)) &&
+        (queue = PyObject_Call(self->type, args, kwargs))
+    ) {
+        if (PyDict_GET_SIZE(self->replies) >= MQUEUE_RPC_MAX_REPLIES) {
+            PyDict_Clear(self->replies);
+        }
+        if (PyDict_SetItem(self->replies, name, queue)) {
+            Py_CLEAR(queue);
+        }
+    }
+    Py_XDECREF(kwargs);
+    Py_XDECREF(args);
+    return (MessageQueue *)queue;
+}
+
+
+/* sends the reply, a reply too long for the client's queue is replaced by an
+   EMSGSIZE error reply, returns 0, 1 if the reply was replaced or -1 */
+static int
+__rpc_reply(RpcServer *self, PyObject *name, uint64_t id, const char *buf,
+            Py_ssize_t len, unsigned int priority)
+{
+    MessageQueue *queue = NULL;
+    Py_ssize_t size = len + MQUEUE_RPC_REPLY_HEADER, res = -1;
+    char *msg = NULL;
+    int32_t status = 0;
+    int err = 0;
+
+    if (!(queue = __rpc_reply_queue(self, name))) {
+        return -1;
+    }
+    if (size > (queue->attr.mq_msgsize - ((queue->codec) ? 1 : 0))) {
+        status = EMSGSIZE;
+        size = MQUEUE_RPC_REPLY_HEADER;
+        len = 0;
+    }
+    if (self->msgsize < size) {
+        if ((msg = PyMem_RawRealloc(self->msg, size))) {
+            self->msg = msg;
+            self->msgsize = size;
+        }
+        else {
+            PyErr_NoMemory();
+        }
+    }
+    if (!PyErr_Occurred()) {
+        memcpy(self->msg, &id, sizeof(id));
+        memcpy((self->msg + sizeof(id)), &status, sizeof(status));
+        memcpy((self->msg + MQUEUE_RPC_REPLY_HEADER), buf, len);
+        Py_BEGIN_ALLOW_THREADS
+        res = _mq_send_msg(queue, self->msg, size, priority, 0, NULL);
+        Py_END_ALLOW_THREADS
+        if (res < 0) {
+            err = errno;
+            // reopen it next time
+            if (PyDict_DelItem(self->replies, name)) {
+                PyErr_Clear();
+            }
+            errno = err;
+            _PyErr_SetFromErrno();
+        }
+    }
+    Py_DECREF(queue);
+    return (res < 0) ? -1 : ((status) ? 1 : 0);
+}
+
+
+static inline RpcServer *
+__rpc_server_new(PyTypeObject *type)
+{
+    RpcServer *self = NULL;
+
+    if ((self = PyObject_GC_NEW(RpcServer, type))) {
+        self->requests = NULL;
+        self->type = NULL;
+        self->replies = NULL;
+        self->msg = NULL;
+        self->msgsize = 0;
+        PyObject_GC_Track(self);
+    }
+    return self;
+}
+
+
+static inline int
+__rpc_server_init(RpcServer *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"requests", NULL};
+    PyObject *requests = NULL;
+
+    if (
+        !PyArg_ParseTupleAndKeywords(args, kwargs, "O:__new__", kwlist,
+                                     &requests) ||
+        !(self->type = _mqueue_rpc_check_queue(Py_TYPE(self), requests)) ||
+        !(self->replies = PyDict_New())
+    ) {
         return -1;
     }
-    return self->attr.mq_curmsgs;
+    self->requests = (MessageQueue *)Py_NewRef(requests);
+    return 0;
+}
+
+
+/* RpcServer_Type ----------------------------------------------------------- */
+
+/* RpcServer_Type.tp_new */
+static PyObject *
+RpcServer_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    RpcServer *self = NULL;
+
+    if ((self = __rpc_server_new(type)) && __rpc_server_init(self, args, kwargs)) {
+        Py_CLEAR(self);
+    }
+    return (PyObject *)self;
 }
 
 
-/* MessageQueue.close() */
-PyDoc_STRVAR(MessageQueue_close_doc,
-"close()");
-
-static PyObject *
-MessageQueue_close(MessageQueue *self)
+/* RpcServer_Type.tp_traverse */
+static int
+RpcServer_tp_traverse(RpcServer *self, visitproc visit, void *arg)
 {
-    return (__mq_close(self)) ? NULL : Py_NewRef(Py_None);
+    Py_VISIT(self->replies);
+    Py_VISIT(self->type);
+    Py_VISIT(self->requests);
+    Py_VISIT(Py_TYPE(self)); // heap type
+    return 0;
 }
 
 
-/* MessageQueue.fileno() */
-PyDoc_STRVAR(MessageQueue_fileno_doc,
-"fileno() -> int\n\
-Returns the underlying file descriptor.");
+/* RpcServer_Type.tp_clear */
+static int
+RpcServer_tp_clear(RpcServer *self)
+{
+    Py_CLEAR(self->replies);
+    Py_CLEAR(self->type);
+    Py_CLEAR(self->requests);
+    return 0;
+}
 
-static PyObject *
-MessageQueue_fileno(MessageQueue *self)
+
+/* RpcServer_Type.tp_dealloc */
+static void
+RpcServer_tp_dealloc(RpcServer *self)
 {
-    return PyLong_FromLong(self->mqd);
+    PyObject_GC_UnTrack(self);
+    if (self->msg) {
+        PyMem_RawFree(self->msg);
+        self->msg = NULL;
+    }
+    RpcServer_tp_clear(self);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_Del(self);
+    Py_XDECREF(type); // heap type
 }
 
 
-/* MessageQueue.send(msg[, priority]) */
-PyDoc_STRVAR(MessageQueue_send_doc,
-"send(msg[, priority]) -> int\n\
-Sends 1 message. Returns the number of bytes sent.");
+/* RpcServer.receive([count, timeout]) */
+PyDoc_STRVAR(RpcServer_receive_doc,
+"receive([count=1, timeout=None]) -> list\n\
+Receives up to count requests (only waits for the first one).\n\
+Returns a list of (token, payload) tuples.");
 
 static PyObject *
-MessageQueue_send(MessageQueue *self, PyObject *args)
+RpcServer_receive(RpcServer *self, PyObject *args, PyObject *kwargs)
 {
-    Py_buffer msg;
-    unsigned int priority = 0;
-    Py_ssize_t size = 0;
+    static char *kwlist[] = {"count", "timeout", NULL};
+    Py_ssize_t count = 1;
+    PyObject *timeout = Py_None;
+    struct timespec ts = { 0 }, *abstime = NULL;
 
-    if (!PyArg_ParseTuple(args, "y*|I:send", &msg, &priority)) {
+    if (
+        !PyArg_ParseTupleAndKeywords(args, kwargs, "|nO:receive", kwlist,
+                                     &count, &timeout) ||
+        _mqueue_rpc_deadline(timeout, &ts, &abstime)
+    ) {
         return NULL;
     }
-    size = Py_MIN(msg.len, self->attr.mq_msgsize);
-    if (__mq_send(self, msg.buf, size, priority)) {
-        PyBuffer_Release(&msg);
-        return _PyErr_SetFromErrno();
+    if (count < 1) {
+        PyErr_SetString(PyExc_ValueError, "count must be greater than 0");
+        return NULL;
     }
-    PyBuffer_Release(&msg);
-    return PyLong_FromSsize_t(size);
+    return __rpc_receive(self, count, abstime);
 }
 
 
-/* MessageQueue.sendall(msg[, priority]) */
-PyDoc_STRVAR(MessageQueue_sendall_doc,
-"sendall(msg[, priority])\n\
-Sends 1 message. This calls send() repeatedly until all data is sent.");
+/* RpcServer.reply(token, payload[, priority]) */
+PyDoc_STRVAR(RpcServer_reply_doc,
+"reply(token, payload[, priority])\n\
+Sends the reply to the request identified by token.");
 
 static PyObject *
-MessageQueue_sendall(MessageQueue *self, PyObject *args)
+RpcServer_reply(RpcServer *self, PyObject *args)
 {
-    Py_buffer msg;
+    PyObject *name = NULL;
+    unsigned long long id = 0;
+    Py_buffer payload = { 0 };
     unsigned int priority = 0;
-    Py_ssize_t size = 0;
-    const char *buf = NULL;
-    Py_ssize_t len = 0;
+    int res = -1;
 
-    if (!PyArg_ParseTuple(args, "y*|I:sendall", &msg, &priority)) {
+    if (
+        !PyArg_ParseTuple(args, "(SK)y*|I:reply", &name, &id, &payload,
+                          &priority)
+    ) {
         return NULL;
     }
-    buf = msg.buf;
-    len = msg.len;
-    do {
-        size = Py_MIN(len, self->attr.mq_msgsize);
-        if (__mq_send(self, buf, size, priority)) {
-            PyBuffer_Release(&msg);
-            return _PyErr_SetFromErrno();
+    res = __rpc_reply(self, name, id, payload.buf, payload.len, priority);
+    PyBuffer_Release(&payload);
+    if (res) {
+        if (res > 0) {
+            PyErr_SetString(PyExc_ValueError, "reply too long");
         }
-        buf += size;
-        len -= size;
-    } while (len > 0);
-    PyBuffer_Release(&msg);
+        return NULL;
+    }
     Py_RETURN_NONE;
 }
 
 
-/* MessageQueue.receive() */
-PyDoc_STRVAR(MessageQueue_receive_doc,
-"receive() -> bytes\n\
-Receives 1 message.");
+/* RpcServer.serve(handler[, count]) */
+PyDoc_STRVAR(RpcServer_serve_doc,
+"serve(handler[, count=16])\n\
+Receives requests by batches of up to count, calls handler(payload) for\n\
+each of them and sends back what it returns (unless it is None).\n\
+Only returns when handler raises an exception.");
 
 static PyObject *
-MessageQueue_receive(MessageQueue *self)
+RpcServer_serve(RpcServer *self, PyObject *args)
 {
-    Py_ssize_t size = -1;
+    PyObject *handler = NULL, *requests = NULL, *request = NULL;
+    PyObject *reply = NULL;
+    Py_ssize_t count = 16, i = 0;
+    Py_buffer view = { 0 };
+    int res = 0;
 
-    if ((size = __mq_receive(self)) < 0) {
-        return _PyErr_SetFromErrno();
+    if (!PyArg_ParseTuple(args, "O|n:serve", &handler, &count)) {
+        return NULL;
     }
-    return PyBytes_FromStringAndSize(self->msg, size);
+    if (count < 1) {
+        PyErr_SetString(PyExc_ValueError, "count must be greater than 0");
+        return NULL;
+    }
+    while (!res && (requests = __rpc_receive(self, count, NULL))) {
+        for (i = 0; !res && (i < PyList_GET_SIZE(requests)); ++i) {
+            request = PyList_GET_ITEM(requests, i);
+            if (!(reply = PyObject_CallOneArg(handler,
+                                              PyTuple_GET_ITEM(request, 1)))) {
+                res = -1;
+            }
+            else if (reply != Py_None) {
+                if (!(res = PyObject_GetBuffer(reply, &view, PyBUF_SIMPLE))) {
+                    res = __rpc_reply(
+                        self,
+                        PyTuple_GET_ITEM(PyTuple_GET_ITEM(request, 0), 0),
+                        PyLong_AsUnsignedLongLong(
+                            PyTuple_GET_ITEM(PyTuple_GET_ITEM(request, 0), 1)
+                        ),
+                        view.buf, view.len, 0
+                    );
+                    PyBuffer_Release(&view);
+                    // the client got an EMSGSIZE error reply instead
+                    if (res > 0) {
+                        res = 0;
+                    }
+                    // the client went away, or is not keeping up
+                    else if (res && PyErr_ExceptionMatches(PyExc_OSError)) {
+                        PyErr_Clear();
+                        res = 0;
+                    }
+                }
+            }
+            Py_XDECREF(reply);
+        }
+        Py_DECREF(requests);
+    }
+    return NULL;
 }
 
 
-/* -------------------------------------------------------------------------- */
+/* RpcServer_Type.tp_methods */
+static PyMethodDef RpcServer_tp_methods[] = {
+    {
+        "receive", (PyCFunction)RpcServer_receive,
+        METH_VARARGS | METH_KEYWORDS, RpcServer_receive_doc
+    },
+    {
+        "reply", (PyCFunction)RpcServer_reply,
+        METH_VARARGS, RpcServer_reply_doc
+    },
+    {
+        "serve", (PyCFunction)RpcServer_serve,
+        METH_VARARGS, RpcServer_serve_doc
+    },
+    {NULL}  /* Sentinel */
+};
 
-static void
-__mq_callback(union sigval sv)
-{
-    PyGILState_STATE gstate = PyGILState_Ensure();
-    MessageQueue *self = (MessageQueue *)sv.sival_ptr;
-    PyObject *result = NULL;
 
-    if ((result = PyObject_CallFunctionObjArgs(self->callback, self, NULL))) {
-        Py_DECREF(result);
+/* RpcServer_Type.tp_members */
+static PyMemberDef RpcServer_tp_members[] = {
+    {
+        "requests", T_OBJECT, offsetof(RpcServer, requests),
+        READONLY, NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+static PyType_Slot rpc_server_type_slots[] = {
+    {Py_tp_doc, "RpcServer(requests)"},
+    {Py_tp_new, RpcServer_tp_new},
+    {Py_tp_traverse, RpcServer_tp_traverse},
+    {Py_tp_clear, RpcServer_tp_clear},
+    {Py_tp_dealloc, RpcServer_tp_dealloc},
+    {Py_tp_methods, RpcServer_tp_methods},
+    {Py_tp_members, RpcServer_tp_members},
+    {0, NULL}
+};
+
+
+static PyType_Spec rpc_server_type_spec = {
+    .name = "mood.mqueue.RpcServer",
+    .basicsize = sizeof(RpcServer),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = rpc_server_type_slots
+};
+
+
+/* --------------------------------------------------------------------------
+   scan
+   -------------------------------------------------------------------------- */
+
+static inline void
+__scan_entry(mqueue_scan_entry *entry, int dfd, const char *filename,
+             int notified)
+{
+    struct mq_attr attr = { 0 };
+    char buf[128];
+    ssize_t len = -1;
+    int fd = -1;
+
+    entry->curmsgs = entry->bytes = entry->maxmsg = entry->msgsize = -1;
+    entry->notify_pid = -1;
+    if (notified) {
+        // closing it would cancel our own registration, leave it alone
+        entry->notify_pid = getpid();
+        return;
     }
-    else {
-        PyErr_WriteUnraisable(self->callback);
+    // opening the file directly gets us both the QSIZE/NOTIFY status and a
+    // descriptor mq_getattr() accepts, without mq_open()
+    if ((fd = openat(dfd, filename, O_RDONLY | O_CLOEXEC | O_NONBLOCK)) == -1) {
+        return;
     }
-    Py_CLEAR(self->callback);
-    PyGILState_Release(gstate);
+    if ((len = read(fd, buf, (sizeof(buf) - 1))) > 0) {
+        buf[len] = '\0';
+        sscanf(buf, "QSIZE:%ld NOTIFY:%*d SIGNO:%*d NOTIFY_PID:%ld",
+               &entry->bytes, &entry->notify_pid);
+    }
+    if (!mq_getattr(fd, &attr)) {
+        entry->curmsgs = attr.mq_curmsgs;
+        entry->maxmsg = attr.mq_maxmsg;
+        entry->msgsize = attr.mq_msgsize;
+    }
+    close(fd);
 }
 
 
-/* -------------------------------------------------------------------------- */
-
-/* MessageQueue.notify([callback]) */
-PyDoc_STRVAR(MessageQueue_notify_doc,
-"notify([callback])\n\
-Register or unregister for notification.");
-
-static PyObject *
-MessageQueue_notify(MessageQueue *self, PyObject *args)
+/* no GIL, returns the number of entries or -1 (errno) */
+static Py_ssize_t
+_mqueue_scan(const char *pattern, mqueue_scan_entry **result)
 {
-    struct sigevent sev = { .sigev_notify = -1 };
-    struct sigevent *sevp = NULL;
-    PyObject *callback = NULL;
+    mqueue_scan_entry *entries = NULL, *tmp = NULL;
+    size_t count = 0, alloc = 0;
+    struct dirent *de = NULL;
+    DIR *dir = NULL;
+    int saved_errno = 0;
 
-    if (!PyArg_ParseTuple(args, "|O:notify", &callback)) {
-        return NULL;
+    if (!(dir = opendir(MQUEUE_FS))) {
+        return -1;
     }
-    if (callback) {
-        if (callback == Py_None) {
-            sev.sigev_notify = SIGEV_NONE;
+    errno = 0;
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
         }
-        else if (PyLong_Check(callback)) {
-            int signum = _PyLong_AsInt(callback);
-            if (signum == -1 && PyErr_Occurred()) {
-                return NULL;
-            }
-            if (signum < 1 || signum >= NSIG) {
-                PyErr_SetString(PyExc_ValueError, "signal number out of range");
-                return NULL;
+        if (count == alloc) {
+            alloc = Py_MAX((alloc << 1), 64);
+            if (!(tmp = PyMem_RawRealloc(entries, (alloc * sizeof(*tmp))))) {
+                errno = ENOMEM;
+                break;
             }
-            sev.sigev_notify = SIGEV_SIGNAL;
-            sev.sigev_signo = signum;
-        }
-        else if (PyCallable_Check(callback)) {
-            sev.sigev_notify = SIGEV_THREAD;
-            sev.sigev_notify_function = __mq_callback;
-            sev.sigev_notify_attributes = NULL;
-            sev.sigev_value.sival_ptr = self;
+            entries = tmp;
         }
-        else {
-            PyErr_SetString(
-                PyExc_TypeError,
-                "a callable, a signal number or None is required"
-            );
-            return NULL;
+        snprintf(entries[count].name, sizeof(entries[count].name), "/%s",
+                 de->d_name);
+        if (!pattern || !fnmatch(pattern, entries[count].name, 0)) {
+            __scan_entry(&entries[count++], dirfd(dir), de->d_name,
+                         _mqueue_notified_contains(de->d_ino));
         }
-        sevp = &sev;
+        errno = 0;
     }
-    if (mq_notify(self->mqd, sevp)) {
-        return _PyErr_SetFromErrno();
+    saved_errno = errno;
+    closedir(dir);
+    if ((errno = saved_errno)) {
+        PyMem_RawFree(entries);
+        return -1;
     }
-    if (sev.sigev_notify == SIGEV_THREAD) {
-        _Py_SET_MEMBER(self->callback, callback);
+    *result = entries;
+    return count;
+}
+
+
+static PyObject *
+__scan_array(mqueue_scan_entry *entries, Py_ssize_t count, size_t offset)
+{
+    PyObject *array_module = NULL, *result = NULL;
+    long *values = NULL;
+    Py_ssize_t i;
+
+    if (!(values = PyMem_Malloc((Py_MAX(count, 1) * sizeof(long))))) {
+        return PyErr_NoMemory();
     }
-    else {
-        Py_CLEAR(self->callback);
+    for (i = 0; i < count; ++i) {
+        values[i] = *(long *)((char *)&entries[i] + offset);
     }
-    Py_RETURN_NONE;
+    if ((array_module = PyImport_ImportModule("array"))) {
+        result = PyObject_CallMethod(array_module, "array", "sy#", "l",
+                                     (char *)values, (count * sizeof(long)));
+        Py_DECREF(array_module);
+    }
+    PyMem_Free(values);
+    return result;
 }
 
 
-/* -------------------------------------------------------------------------- */
+/* --------------------------------------------------------------------------
+   C API
+   -------------------------------------------------------------------------- */
 
-static inline int
-__buf_exported(PyByteArrayObject *buf)
+static PyObject *
+_mqueue_capi_set_error(int err)
 {
-    if (buf->ob_exports > 0) {
-        PyErr_SetString(
-            PyExc_BufferError,
-            "Existing exports of data: object cannot be re-sized"
-        );
+    errno = err;
+    return _PyErr_SetFromErrno();
+}
+
+
+static mqd_t
+_mqueue_capi_get_mqd(PyObject *queue)
+{
+    return ((MessageQueue *)queue)->mqd;
+}
+
+
+static Py_ssize_t
+_mqueue_capi_send(PyObject *queue, const char *buf, size_t size,
+                  unsigned int priority, const struct timespec *abstime)
+{
+    return _mq_send_msg((MessageQueue *)queue, buf, size, priority, 0, abstime);
+}
+
+
+static size_t
+_mqueue_capi_get_max_size(PyObject *queue)
+{
+    return __mq_maxsize((MessageQueue *)queue);
+}
+
+
+static Py_ssize_t
+_mqueue_capi_receive(PyObject *queue, char *buf, size_t size,
+                     unsigned int *priority, const struct timespec *abstime)
+{
+    MessageQueue *self = (MessageQueue *)queue;
+    mqueue_buffer *buffer = NULL;
+    const char *data = NULL;
+    char *dst = buf;
+    size_t dsize = size;
+    Py_ssize_t res = -1;
+
+    // before anything is dequeued
+    if (size < __mq_maxsize(self)) {
+        errno = EMSGSIZE;
         return -1;
     }
-    return 0;
+    if (!self->codec) {
+        // straight into buf
+        if (abstime) {
+            return mq_timedreceive(self->mqd, buf, size, priority, abstime);
+        }
+        return mq_receive(self->mqd, buf, size, priority);
+    }
+    // decoded straight into buf
+    if (!(buffer = __mq_buffer_get(self))) {
+        return -1;
+    }
+    if (
+        ((res = __mq_timedreceive(self, buffer->msg, priority,
+                                  abstime)) >= 0) &&
+        ((res = __mq_decode(self, buffer->msg, res, &data, &dst, &dsize,
+                            size)) > 0) &&
+        (data != buf)
+    ) {
+        memcpy(buf, data, res);
+    }
+    __mq_buffer_put(self, buffer);
+    return res;
 }
 
 
-static inline void
-__buf_shrink(PyByteArrayObject *buf, Py_ssize_t size)
+static Py_ssize_t
+_mqueue_capi_send_batch(PyObject *queue, const struct iovec *msgs,
+                        size_t count, unsigned int priority,
+                        const struct timespec *abstime)
 {
-    // XXX: very bad shortcut ¯\_(ツ)_/¯
-    Py_SIZE(buf) = size;
-    buf->ob_start[size] = '\0';
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (
+            _mqueue_capi_send(queue, msgs[i].iov_base, msgs[i].iov_len,
+                              priority, abstime) < 0
+        ) {
+            return (i) ? (Py_ssize_t)i : -1;
+        }
+    }
+    return count;
 }
 
 
-static inline int
-__buf_realloc(PyByteArrayObject *buf, Py_ssize_t nalloc)
+static Py_ssize_t
+_mqueue_capi_receive_batch(PyObject *queue, struct iovec *msgs,
+                           size_t count, unsigned int *priorities,
+                           const struct timespec *abstime)
 {
-    Py_ssize_t alloc = 0;
-    void *bytes = NULL;
-
-    if (buf->ob_alloc < nalloc) {
-        alloc = Py_MAX(nalloc, (buf->ob_alloc << 1));
-        if (!(bytes = PyObject_Realloc(buf->ob_bytes, alloc))) {
-            return -1;
+    static const struct timespec expired = { 0 };
+    Py_ssize_t size = -1;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        // only wait for the first one
+        if (
+            (size = _mqueue_capi_receive(queue, msgs[i].iov_base,
+                                         msgs[i].iov_len,
+                                         (priorities) ? &priorities[i] : NULL,
+                                         (i) ? &expired : abstime)) < 0
+        ) {
+            if (i && (errno == EAGAIN || errno == ETIMEDOUT)) {
+                break;
+            }
+            return (i) ? (Py_ssize_t)i : -1;
         }
-        buf->ob_start = buf->ob_bytes = bytes;
-        buf->ob_alloc = alloc;
+        msgs[i].iov_len = size;
     }
-    return 0;
+    return i;
 }
 
 
-static inline int
-__buf_resize(PyByteArrayObject *buf, size_t size)
+static void
+_mqueue_capi_destructor(PyObject *capsule)
 {
-    if ((size >= PY_SSIZE_T_MAX) || __buf_realloc(buf, (size + 1))) {
-        PyErr_NoMemory();
-        return -1;
-    }
-    return 0;
+    MQueue_CAPI *capi = PyCapsule_GetPointer(capsule, MQUEUE_CAPSULE_NAME);
+
+    Py_XDECREF(capi->MessageQueue_Type);
+    PyMem_Free(capi);
 }
 
 
-static inline int
-__buf_grow(PyByteArrayObject *buf, const char *bytes, size_t size)
+static int
+_mqueue_add_capi(PyObject *module)
 {
-    size_t start = Py_SIZE(buf), nsize = start + size;
+    MQueue_CAPI *capi = NULL;
+    PyObject *capsule = NULL;
 
-    memcpy((buf->ob_bytes + start), bytes, size);
-    Py_SIZE(buf) = nsize;
-    buf->ob_bytes[nsize] = '\0';
+    if (!(capi = PyMem_Calloc(1, sizeof(MQueue_CAPI)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    capi->version = MQUEUE_CAPI_VERSION;
+    capi->size = sizeof(MQueue_CAPI);
+    if (
+        !(capi->MessageQueue_Type =
+            (PyTypeObject *)PyObject_GetAttrString(module, "MessageQueue"))
+    ) {
+        PyMem_Free(capi);
+        return -1;
+    }
+    capi->SetError = _mqueue_capi_set_error;
+    capi->GetMqd = _mqueue_capi_get_mqd;
+    capi->Send = _mqueue_capi_send;
+    capi->Receive = _mqueue_capi_receive;
+    capi->SendBatch = _mqueue_capi_send_batch;
+    capi->ReceiveBatch = _mqueue_capi_receive_batch;
+    capi->GetMaxSize = _mqueue_capi_get_max_size;
+    if (
+        !(capsule = PyCapsule_New(capi, MQUEUE_CAPSULE_NAME,
+                                  _mqueue_capi_destructor))
+    ) {
+        Py_DECREF(capi->MessageQueue_Type);
+        PyMem_Free(capi);
+        return -1;
+    }
+    if (PyModule_AddObject(module, "_C_API", capsule)) {
+        Py_DECREF(capsule);
+        return -1;
+    }
     return 0;
 }
 
 
-/* -------------------------------------------------------------------------- */
+/* --------------------------------------------------------------------------
+   module
+   -------------------------------------------------------------------------- */
 
-/* MessageQueue.fill(buf[, priority]) */
-PyDoc_STRVAR(MessageQueue_fill_doc,
-"fill(buf[, priority])\n\
-Fills the queue with messages from buf.");
+/* mqueue.register_local(name) */
+PyDoc_STRVAR(mqueue_register_local_doc,
+"register_local(name)\n\
+Register name as a process-local queue name (see open()).");
 
 static PyObject *
-MessageQueue_fill(MessageQueue *self, PyObject *args)
+mqueue_register_local(PyObject *module, PyObject *args)
 {
-    PyByteArrayObject *buf = NULL;
-    unsigned int priority = 0;
-    Py_ssize_t len, size = 0;
+    module_state *state = NULL;
+    PyObject *name = NULL, *result = NULL;
 
-    if (!PyArg_ParseTuple(args, "Y|I:fill", &buf, &priority) ||
-        __buf_exported(buf)) {
-        return NULL;
-    }
-    while ((len = Py_SIZE(buf)) > 0) {
-        size = Py_MIN(len, self->attr.mq_msgsize);
-        if (__mq_send(self, buf->ob_start, size, priority)) {
-            return _PyErr_SetFromErrno();
+    if (
+        (state = __PyModule_GetState__(module)) &&
+        PyArg_ParseTuple(args, "O&:register_local",
+                         PyUnicode_FSConverter, &name)
+    ) {
+        if (PyDict_SetDefault(state->locals, name, Py_None)) {
+            result = Py_NewRef(Py_None);
         }
-        // XXX: very bad shortcut ¯\_(ツ)_/¯
-        buf->ob_start += size;
-        __buf_shrink(buf, (len - size));
+        Py_DECREF(name);
     }
-    Py_RETURN_NONE;
+    return result;
 }
 
 
-/* MessageQueue.drain(buf) */
-PyDoc_STRVAR(MessageQueue_drain_doc,
-"drain(buf) -> bool\n\
-Drains all messages from the queue into buf.\n\
-Stops when receiving an empty message.\n\
-Returns whether the last message received was empty.");
+/* mqueue.unregister_local(name) */
+PyDoc_STRVAR(mqueue_unregister_local_doc,
+"unregister_local(name)\n\
+Unregister a process-local queue name (already open queues are not affected).");
 
 static PyObject *
-MessageQueue_drain(MessageQueue *self, PyObject *args)
+mqueue_unregister_local(PyObject *module, PyObject *args)
 {
-    PyByteArrayObject *buf = NULL;
-    long i, len = 0;
-    Py_ssize_t size = -1;
+    module_state *state = NULL;
+    PyObject *name = NULL, *result = NULL;
+    int res = -1;
 
-    if (!PyArg_ParseTuple(args, "Y:drain", &buf) ||
-        __buf_exported(buf)) {
-        return NULL;
-    }
-    if (mq_getattr(self->mqd, &self->attr)) {
-        return _PyErr_SetFromErrno();
-    }
-    len = self->attr.mq_curmsgs ? self->attr.mq_curmsgs : 1;
-    for (i = 0; i < len; ++i) {
-        if ((size = __mq_receive(self)) < 0) {
-            return _PyErr_SetFromErrno();
-        }
-        if (!size) {
-            break;
-        }
-        if ((i == 0 && __buf_resize(buf, (len * self->attr.mq_msgsize))) ||
-            __buf_grow(buf, self->msg, size)) {
-            return NULL;
+    if (
+        (state = __PyModule_GetState__(module)) &&
+        PyArg_ParseTuple(args, "O&:unregister_local",
+                         PyUnicode_FSConverter, &name)
+    ) {
+        if (
+            ((res = PyDict_Contains(state->locals, name)) >= 0) &&
+            (!res || !PyDict_DelItem(state->locals, name))
+        ) {
+            result = Py_NewRef(Py_None);
         }
+        Py_DECREF(name);
     }
-    return PyBool_FromLong((size == 0));
+    return result;
 }
 
 
-/* MessageQueue_Type.tp_methods */
-static PyMethodDef MessageQueue_tp_methods[] = {
-    {
-        "close", (PyCFunction)MessageQueue_close,
-        METH_NOARGS, MessageQueue_close_doc
-    },
-    {
-        "fileno", (PyCFunction)MessageQueue_fileno,
-        METH_NOARGS, MessageQueue_fileno_doc
-    },
-    {
-        "send", (PyCFunction)MessageQueue_send,
-        METH_VARARGS, MessageQueue_send_doc
-    },
-    {
-        "sendall", (PyCFunction)MessageQueue_sendall,
-        METH_VARARGS, MessageQueue_sendall_doc
-    },
-    {
-        "receive", (PyCFunction)MessageQueue_receive,
-        METH_NOARGS, MessageQueue_receive_doc
-    },
-    {
-        "notify", (PyCFunction)MessageQueue_notify,
-        METH_VARARGS, MessageQueue_notify_doc
-    },
-    {
-        "fill", (PyCFunction)MessageQueue_fill,
-        METH_VARARGS, MessageQueue_fill_doc
-    },
-    {
-        "drain", (PyCFunction)MessageQueue_drain,
-        METH_VARARGS, MessageQueue_drain_doc
-    },
-    {NULL}  /* Sentinel */
-};
-
-
-/* MessageQueue_Type.tp_members */
-static PyMemberDef MessageQueue_tp_members[] = {
-    {
-        "flags", T_INT, offsetof(MessageQueue, flags),
-        READONLY, NULL
-    },
-    {
-        "mode", T_UINT, offsetof(MessageQueue, mode),
-        READONLY, NULL
-    },
-    {
-        "maxmsg", T_LONG, offsetof(MessageQueue, attr.mq_maxmsg),
-        READONLY, NULL
-    },
-    {
-        "msgsize", T_LONG, offsetof(MessageQueue, attr.mq_msgsize),
-        READONLY, NULL
-    },
-    {NULL}  /* Sentinel */
-};
-
+/* mqueue.open(name, flags[, mode=0o600, maxmsg=-1, msgsize=-1, codec=None]) */
+PyDoc_STRVAR(mqueue_open_doc,
+"open(name, flags[, mode=0o600, maxmsg=-1, msgsize=-1, codec=None])\n\
+Returns a LocalQueue if name is registered as process-local,\n\
+a MessageQueue otherwise.");
 
-/* MessageQueue.name */
 static PyObject *
-MessageQueue_name_get(MessageQueue *self, void *closure)
+mqueue_open(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    return PyUnicode_DecodeFSDefault(PyBytes_AS_STRING(self->name));
-}
-
+    module_state *state = NULL;
+    PyObject *name = NULL, *type = NULL, *result = NULL;
+    int res = -1;
 
-/* MessageQueue.closed */
-static PyObject *
-MessageQueue_closed_get(MessageQueue *self, void *closure)
-{
-    return PyBool_FromLong((self->mqd == -1));
+    if (!(state = __PyModule_GetState__(module))) {
+        return NULL;
+    }
+    if (PyTuple_GET_SIZE(args)) {
+        name = PyTuple_GET_ITEM(args, 0);
+    }
+    else if (kwargs) {
+        name = PyDict_GetItemString(kwargs, "name");
+    }
+    if (!name) {
+        PyErr_SetString(PyExc_TypeError,
+                        "open() missing required argument 'name' (pos 1)");
+        return NULL;
+    }
+    if (!PyUnicode_FSConverter(name, &name)) {
+        return NULL;
+    }
+    res = PyDict_Contains(state->locals, name);
+    Py_DECREF(name);
+    if (
+        (res >= 0) &&
+        (type = PyObject_GetAttrString(module,
+                                       (res) ? "LocalQueue" : "MessageQueue"))
+    ) {
+        result = PyObject_Call(type, args, kwargs);
+        Py_DECREF(type);
+    }
+    return result;
 }
 
 
-/* MessageQueue.blocking */
-static PyObject *
-MessageQueue_blocking_get(MessageQueue *self, void *closure)
-{
-    return PyBool_FromLong(__mq_getblocking(self));
-}
+/* mqueue.scan([pattern]) */
+PyDoc_STRVAR(mqueue_scan_doc,
+"scan([pattern]) -> (names, curmsgs, bytes, maxmsg, msgsize, notify_pid)\n\
+Returns the state of all the queues (whose name matches pattern).\n\
+Queues this process is registered for notification on are not opened (that\n\
+would cancel the registration), only their notify_pid is reported.");
 
-static int
-MessageQueue_blocking_set(MessageQueue *self, PyObject *value, void *closure)
+static PyObject *
+mqueue_scan(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    int blocking = -1;
+    static char *kwlist[] = {"pattern", NULL};
+    const char *pattern = NULL;
+    mqueue_scan_entry *entries = NULL;
+    Py_ssize_t i, count = -1;
+    PyObject *result = NULL, *names = NULL, *name = NULL;
 
-    _Py_PROTECTED_ATTRIBUTE(value, -1);
-    if ((blocking = PyObject_IsTrue(value)) < 0) {
-        return -1;
+    if (
+        !PyArg_ParseTupleAndKeywords(args, kwargs, "|z:scan", kwlist,
+                                     &pattern)
+    ) {
+        return NULL;
     }
-    return __mq_setblocking(self, blocking);
+    Py_BEGIN_ALLOW_THREADS
+    count = _mqueue_scan(pattern, &entries);
+    Py_END_ALLOW_THREADS
+    if (count < 0) {
+        return _PyErr_SetFromErrnoWithFilename(MQUEUE_FS);
+    }
+    if ((names = PyList_New(count))) {
+        for (i = 0; i < count; ++i) {
+            if (!(name = PyUnicode_DecodeFSDefault(entries[i].name))) {
+                Py_CLEAR(names);
+                break;
+            }
+            PyList_SET_ITEM(names, i, name);
+        }
+    }
+    if (names) {
+        result = Py_BuildValue(
+            "(NNNNNN)", names,
+            __scan_array(entries, count, offsetof(mqueue_scan_entry, curmsgs)),
+            __scan_array(entries, count, offsetof(mqueue_scan_entry, bytes)),
+            __scan_array(entries, count, offsetof(mqueue_scan_entry, maxmsg)),
+            __scan_array(entries, count, offsetof(mqueue_scan_entry, msgsize)),
+            __scan_array(entries, count, offsetof(mqueue_scan_entry, notify_pid))
+        );
+    }
+    PyMem_RawFree(entries);
+    return result;
 }
 
 
-/* MessageQueue_Type.tp_getset */
-static PyGetSetDef MessageQueue_tp_getset[] = {
+/* mqueue_def.m_methods */
+static PyMethodDef mqueue_m_methods[] = {
     {
-        "name", (getter)MessageQueue_name_get,
-        _Py_READONLY_ATTRIBUTE, NULL, NULL
+        "register_local", (PyCFunction)mqueue_register_local,
+        METH_VARARGS, mqueue_register_local_doc
     },
     {
-        "closed", (getter)MessageQueue_closed_get,
-        _Py_READONLY_ATTRIBUTE, NULL, NULL
+        "unregister_local", (PyCFunction)mqueue_unregister_local,
+        METH_VARARGS, mqueue_unregister_local_doc
     },
     {
-        "blocking", (getter)MessageQueue_blocking_get,
-        (setter)MessageQueue_blocking_set, NULL, NULL
+        "open", (PyCFunction)(void(*)(void))mqueue_open,
+        METH_VARARGS | METH_KEYWORDS, mqueue_open_doc
+    },
+    {
+        "scan", (PyCFunction)(void(*)(void))mqueue_scan,
+        METH_VARARGS | METH_KEYWORDS, mqueue_scan_doc
     },
     {NULL}  /* Sentinel */
 };
 
 
-static PyType_Slot mqueue_type_slots[] = {
-    {Py_tp_doc, "MessageQueue(name, flags[, mode=0o600, maxmsg=-1, msgsize=-1])"},
-    {Py_tp_new, MessageQueue_tp_new},
-    {Py_tp_traverse, MessageQueue_tp_traverse},
-    {Py_tp_finalize, MessageQueue_tp_finalize},
-    {Py_tp_clear, MessageQueue_tp_clear},
-    {Py_tp_dealloc, MessageQueue_tp_dealloc},
-    {Py_tp_repr, MessageQueue_tp_repr},
-    {Py_sq_length, MessageQueue_sq_length},
-    {Py_tp_methods, MessageQueue_tp_methods},
-    {Py_tp_members, MessageQueue_tp_members},
-    {Py_tp_getset, MessageQueue_tp_getset},
-    {0, NULL}
-};
-
-
-static PyType_Spec mqueue_type_spec = {
-    .name = "mood.mqueue.MessageQueue",
-    .basicsize = sizeof(MessageQueue),
-    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_FINALIZE,
-    .slots = mqueue_type_slots
-};
-
-
-/* --------------------------------------------------------------------------
-   module
-   -------------------------------------------------------------------------- */
-
 /* mqueue_def.m_slots.Py_mod_exec */
+static pthread_once_t mqueue_atfork_once = PTHREAD_ONCE_INIT;
+
 static int
 mqueue_m_slots_exec(PyObject *module)
 {
     module_state *state = NULL;
 
+    pthread_once(&mqueue_atfork_once, __mq_atfork);
     if (
         !(state = __PyModule_GetState__(module)) ||
+        !(state->locals = PyDict_New()) ||
         _mqueue_get_rlimit_cur(RLIMIT_MSGQUEUE, &state->max_bytes) ||
         _mqueue_get_limit(MQUEUE_DEFAULT_MAXMSG, &state->default_maxmsg) ||
         _mqueue_get_limit(MQUEUE_MAX_MAXMSG, &state->max_maxmsg) ||
         _mqueue_get_limit(MQUEUE_DEFAULT_MSGSIZE, &state->default_msgsize) ||
         _mqueue_get_limit(MQUEUE_MAX_MSGSIZE, &state->max_msgsize) ||
         _PyModule_AddTypeFromSpec(module, &mqueue_type_spec, NULL, NULL) ||
+        _mqueue_register_reducer(module) ||
+        _mqueue_add_record_type(module) ||
+        _PyModule_AddTypeFromSpec(module, &local_type_spec, NULL, NULL) ||
+        _PyModule_AddTypeFromSpec(module, &rpc_client_type_spec, NULL, NULL) ||
+        _PyModule_AddTypeFromSpec(module, &rpc_server_type_spec, NULL, NULL) ||
+        _mqueue_add_capi(module) ||
         PyModule_AddStringConstant(module, "__version__", PKG_VERSION)
     ) {
         return -1;
@@ -902,16 +5952,57 @@ mqueue_m_slots_exec(PyObject *module)
 /* mqueue_def.m_slots */
 static struct PyModuleDef_Slot mqueue_m_slots[] = {
     {Py_mod_exec, mqueue_m_slots_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
     {0, NULL}
 };
 
+/* mqueue_def.m_traverse */
+static int
+mqueue_m_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    module_state *state = PyModule_GetState(module);
+
+    if (state) {
+        Py_VISIT(state->locals);
+    }
+    return 0;
+}
+
+
+/* mqueue_def.m_clear */
+static int
+mqueue_m_clear(PyObject *module)
+{
+    module_state *state = PyModule_GetState(module);
+
+    if (state) {
+        Py_CLEAR(state->locals);
+    }
+    return 0;
+}
+
+
+/* mqueue_def.m_free */
+static void
+mqueue_m_free(void *module)
+{
+    mqueue_m_clear((PyObject *)module);
+}
+
+
 /* mqueue_def */
 static PyModuleDef mqueue_def = {
     PyModuleDef_HEAD_INIT,
     .m_name = "mqueue",
     .m_doc = "Python POSIX message queues interface (Linux only)",
     .m_size = sizeof(module_state),
+    .m_methods = mqueue_m_methods,
     .m_slots = mqueue_m_slots,
+    .m_traverse = mqueue_m_traverse,
+    .m_clear = mqueue_m_clear,
+    .m_free = mqueue_m_free,
 };
 
 
@@ -0,0 +1,132 @@
+#ifndef Py_MOOD_MQUEUE_API_H
+#define Py_MOOD_MQUEUE_API_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "Python.h"
+
+#include <mqueue.h>
+#include <sys/uio.h>
+#include <time.h>
+
+
+/*
+    mood.mqueue C API
+
+    Usage:
+
+        #include "mqueue_api.h"
+
+        // once, in your module init (with the GIL held)
+        if (MQueue_Import() < 0) {
+            return NULL;
+        }
+
+        // with the GIL held
+        if (!MQueue_Check(obj)) { ... }
+        Py_INCREF(obj); // keep the queue alive
+
+        // without the GIL
+        Py_BEGIN_ALLOW_THREADS
+        size = MQueue_API->Send(obj, buf, len, 0, NULL);
+        Py_END_ALLOW_THREADS
+
+        // with the GIL held
+        if (size < 0) {
+            MQueue_API->SetError(errno);
+            ...
+        }
+
+    Send/Receive/SendBatch/ReceiveBatch do not need the GIL, they return -1
+    and set errno on error. abstime (CLOCK_REALTIME) may be NULL, in which
+    case they block according to the queue's blocking mode.
+    They honour the queue's codec and spool, and, like the Python methods,
+    can be called concurrently on the same MessageQueue object (receives, and
+    sends through a codec, are serialized on the object).
+*/
+
+
+#define MQUEUE_CAPI_VERSION 1
+#define MQUEUE_CAPSULE_NAME "mood.mqueue._C_API"
+
+
+typedef struct {
+    int version;
+    size_t size;
+    PyTypeObject *MessageQueue_Type;
+
+    /* GIL required */
+
+    /* sets the exception the module would raise for err, returns NULL */
+    PyObject *(*SetError)(int err);
+
+    /* GIL not required */
+
+    /* the underlying message queue descriptor (-1 if closed) */
+    mqd_t (*GetMqd)(PyObject *queue);
+    /* sends 1 message (truncated to the queue's msgsize),
+       returns the number of bytes of buf sent */
+    Py_ssize_t (*Send)(PyObject *queue, const char *buf, size_t size,
+                       unsigned int priority, const struct timespec *abstime);
+    /* receives 1 message into buf, returns its size, fails with EMSGSIZE
+       (before anything is dequeued) if size is less than GetMaxSize() */
+    Py_ssize_t (*Receive)(PyObject *queue, char *buf, size_t size,
+                          unsigned int *priority,
+                          const struct timespec *abstime);
+    /* sends count messages, returns the number of messages sent (errno is
+       set if less than count) */
+    Py_ssize_t (*SendBatch)(PyObject *queue, const struct iovec *msgs,
+                            size_t count, unsigned int priority,
+                            const struct timespec *abstime);
+    /* receives up to count messages (only waits for the first one), sets
+       msgs[i].iov_len to the size of each message, returns the number of
+       messages received */
+    Py_ssize_t (*ReceiveBatch)(PyObject *queue, struct iovec *msgs,
+                               size_t count, unsigned int *priorities,
+                               const struct timespec *abstime);
+    /* the buffer size Receive/ReceiveBatch need: the queue's msgsize, or
+       8 * (msgsize - 1) if a codec is in use */
+    size_t (*GetMaxSize)(PyObject *queue);
+} MQueue_CAPI;
+
+
+static MQueue_CAPI *MQueue_API = NULL;
+
+
+#define MQueue_Check(op) PyObject_TypeCheck((op), MQueue_API->MessageQueue_Type)
+
+
+static inline int
+MQueue_Import(void)
+{
+    PyObject *module = NULL;
+    MQueue_CAPI *capi = NULL;
+
+    // PyCapsule_Import() does not import submodules
+    if (!(module = PyImport_ImportModule("mood.mqueue"))) {
+        return -1;
+    }
+    Py_DECREF(module);
+    if (!(capi = (MQueue_CAPI *)PyCapsule_Import(MQUEUE_CAPSULE_NAME, 0))) {
+        return -1;
+    }
+    if (capi->version < MQUEUE_CAPI_VERSION) {
+        PyErr_Format(
+            PyExc_ImportError,
+            "mood.mqueue C API version %d is older than %d",
+            capi->version,
+            MQUEUE_CAPI_VERSION
+        );
+        return -1;
+    }
+    MQueue_API = capi;
+    return 0;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MOOD_MQUEUE_API_H */